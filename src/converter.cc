@@ -1,7 +1,16 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
 #include <iostream>
+#include <memory_resource>
 #include <queue>
 
 #include "converter.h"
+#include "route_count.h"
+#include "route_set.h"
+#include "thread_pool.h"
+#include "track_graph.h"
 
 namespace converter {
 
@@ -29,42 +38,74 @@ void add_stations(const geometry::Map& geomap, rc::Map& rcmap) {
     }
 }
 
-struct Track {
-    int point_id;
-    int line_id;
-    int index_in_line;
-    bool forward;
-    bool is_end = false;
-    int next_index = -1;
+// routes share their common prefixes: each node stores the id of one track and a link to its parent,
+// so branching a route costs one 8-byte node instead of a copy of the whole track list
+struct RouteNode {
+    int track_id;
+    int parent;
+};
+
+static_assert(sizeof(RouteNode) == 8);
+
+// all storage of a route tree comes from the memory resource of its search,
+// so it is released in bulk when the search returns
+struct RouteTree {
+    std::pmr::vector<RouteNode> nodes;
+    std::pmr::vector<int> refs;
+    std::pmr::vector<int> free_nodes;
+
+    explicit RouteTree(std::pmr::memory_resource* resource)
+        : nodes(resource), refs(resource), free_nodes(resource) {}
+
+    // append a track after parent (-1 for a new root); the returned node holds one reference
+    int extend(int parent, int track_id) {
+        int node;
+        if (!free_nodes.empty()) {
+            node = free_nodes.back();
+            free_nodes.pop_back();
+        } else {
+            node = static_cast<int>(nodes.size());
+            nodes.emplace_back();
+            refs.emplace_back();
+        }
+        nodes[node] = RouteNode{track_id, parent};
+        refs[node] = 1;
+        if (parent != -1) ++refs[parent];
+        return node;
+    }
 
-    int get_next_index() const {
-        return next_index != -1 ? next_index : (forward ? index_in_line + 1 : index_in_line - 1);
+    // drop one reference to node, recycling every ancestor that is no longer shared
+    void release(int node) {
+        while (node != -1 && --refs[node] == 0) {
+            free_nodes.push_back(node);
+            node = nodes[node].parent;
+        }
     }
-};
 
-struct Point : geometry::Point {
-    std::vector<Track> tracks;
+    // flatten the route ending at node into a list of track ids, from root to node
+    void collect(int node, std::pmr::vector<int>& track_ids) const {
+        track_ids.clear();
+        for (; node != -1; node = nodes[node].parent) {
+            track_ids.push_back(nodes[node].track_id);
+        }
+        std::reverse(track_ids.begin(), track_ids.end());
+    }
 };
 
 struct RouteEntry {
-    static int next_id;
-    int id;
-
-    std::vector<Track> tracks;
-    int remaining_count = 65535; // effectively infinite
+    int node = -1; // last node of this route in the route tree
+    int track_id = -1; // last track of this route
+    int remaining_count = unlimited_remaining_count;
 
     void push_back(
-        const Track& track, const geometry::Map& geomap, 
+        int new_track_id, RouteTree& tree, const TrackGraph& graph, 
         const std::unordered_map<int, int>& segmented_lines
     ) {
-        tracks.push_back(track);
-        if (geomap.points.contains(track.point_id) && 
-            geomap.points.at(track.point_id).type == geometry::Point::Type::Station) {
-            --remaining_count;
-        }
-        remaining_count = std::min(remaining_count,
-            segmented_lines.contains(track.line_id) ? segmented_lines.at(track.line_id) : geomap.config.max_length
-        );
+        track_id = new_track_id;
+        int parent = node;
+        node = tree.extend(parent, track_id);
+        tree.release(parent);
+        remaining_count = graph.remaining_after(remaining_count, track_id, segmented_lines);
     }
 
     bool full() const {
@@ -72,165 +113,273 @@ struct RouteEntry {
     }
 };
 
-// if new line or the inverse of new line is a sub-route of existing line, do nothing
-// if existing line or the inverse of existing line is a sub-route of new line, remove existing line and add new line
-void add_and_remove_duplicate(std::unordered_map<int, rc::Line>& lines, rc::Line&& new_line) {
-    if (new_line.station_ids.size() < 2) return;
-    bool erased = false;
-    for (auto it = lines.begin(); it != lines.end(); ) {
-        auto& line = it->second;
-        std::vector<int> rev_line = line.station_ids;
-        std::reverse(rev_line.begin(), rev_line.end());
-        auto is_subroute = [](const std::vector<int>& a, const std::vector<int>& b) {
-            if (a.empty()) return true;
-            if (a.size() > b.size()) return false;
-            for (size_t i = 0; i <= b.size() - a.size(); ++i) {
-                if (std::equal(a.begin(), a.end(), b.begin() + i)) return true;
+// a step of the depth-first search; the frames on the stack form the current route
+struct SearchFrame {
+    int track_id;
+    int remaining_count;
+    int next_successor = 0;
+};
+
+// Enumerates the routes starting from one seed track at a time. Each search owns its memory:
+// a size-class pool recycles freed blocks, and everything is handed back to the arena and
+// released at once when the search is destroyed. Searches are independent of each other,
+// so seeds can be enumerated on different threads.
+class RouteSearch {
+public:
+    RouteSearch(const TrackGraph& graph, const std::unordered_map<int, int>& segmented_lines)
+        : graph(graph), segmented_lines(segmented_lines), pool(&arena), tree(&pool),
+          track_ids(&pool), station_ids(&pool), stack(&pool),
+          q(std::pmr::deque<RouteEntry>(&pool)) {}
+
+    // enumerate every route starting with the seed track and pass the station ids of each
+    // finished route to emit; the search stops early and returns false once emit returns false
+    template <typename Emit>
+    bool run(int seed, Emit&& emit) {
+        if (graph.geomap.config.search_mode == geometry::Map::Config::SearchMode::DepthFirst) {
+            return run_depth_first(seed, emit);
+        }
+        return run_breadth_first(seed, emit);
+    }
+
+private:
+    const TrackGraph& graph;
+    const std::unordered_map<int, int>& segmented_lines;
+
+    std::pmr::monotonic_buffer_resource arena;
+    std::pmr::unsynchronized_pool_resource pool;
+
+    RouteTree tree;
+    std::pmr::vector<int> track_ids;
+    std::pmr::vector<int> station_ids;
+    std::pmr::vector<SearchFrame> stack;
+    std::queue<RouteEntry, std::pmr::deque<RouteEntry>> q;
+
+    // turn the tracks in track_ids into a station list and emit it
+    template <typename Emit>
+    bool emit_route(Emit& emit) {
+        if (track_ids.size() < 2) return true;
+        const geometry::Map& geomap = graph.geomap;
+        station_ids.clear();
+        for (int track_id : track_ids) {
+            const Track& track = graph.track(track_id);
+            if (!track.is_station) continue;
+            int id = geomap.point_to_group.contains(track.point_id) ? geomap.point_to_group.at(track.point_id)->id : track.point_id;
+            if (!geomap.config.merge_consecutive_duplicates || station_ids.empty() || station_ids.back() != id) {
+                station_ids.push_back(id);
             }
-            return false;
-        };
-        if (!erased && is_subroute(new_line.station_ids, line.station_ids) || 
-                       is_subroute(new_line.station_ids, rev_line)) {
-            // new line is sub-route of existing line, do nothing
-            return;
         }
-        if (is_subroute(line.station_ids, new_line.station_ids) || 
-            is_subroute(rev_line, new_line.station_ids)) {
-            // existing line is sub-route of new line, remove existing line
-            it = lines.erase(it);
-            erased = true;
-            continue;
+        return emit(static_cast<const std::pmr::vector<int>&>(station_ids));
+    }
+
+    // memory is bounded by the length of the current route,
+    // and finished routes are emitted as soon as they are found
+    template <typename Emit>
+    bool run_depth_first(int seed, Emit& emit) {
+        stack.clear();
+        stack.push_back(SearchFrame{
+            .track_id = seed,
+            .remaining_count = graph.remaining_after(unlimited_remaining_count, seed, segmented_lines)
+        });
+        while (!stack.empty()) {
+            SearchFrame& frame = stack.back();
+            std::span<const int> nexts = graph.successors(frame.track_id);
+            if (frame.next_successor == 0 && (nexts.empty() || frame.remaining_count <= 0)) {
+                track_ids.clear();
+                for (const auto& f : stack) {
+                    track_ids.push_back(f.track_id);
+                }
+                if (!emit_route(emit)) return false;
+                stack.pop_back();
+                continue;
+            }
+            if (frame.next_successor == static_cast<int>(nexts.size())) {
+                stack.pop_back();
+                continue;
+            }
+            int next_track_id = nexts[frame.next_successor++];
+            int next_remaining = graph.remaining_after(frame.remaining_count, next_track_id, segmented_lines);
+            stack.push_back(SearchFrame{
+                .track_id = next_track_id,
+                .remaining_count = next_remaining
+            });
         }
-        ++it;
+        return true;
     }
-    lines.emplace(new_line.id, std::move(new_line));
+
+    // no need to track visited states as we care about all possible routes
+    template <typename Emit>
+    bool run_breadth_first(int seed, Emit& emit) {
+        RouteEntry seed_entry;
+        seed_entry.push_back(seed, tree, graph, segmented_lines);
+        q.push(std::move(seed_entry));
+
+        while (!q.empty()) {
+            RouteEntry entry = std::move(q.front());
+            q.pop();
+            std::span<const int> nexts = graph.successors(entry.track_id);
+            if (nexts.empty() || entry.full()) {
+                tree.collect(entry.node, track_ids);
+                tree.release(entry.node);
+                if (!emit_route(emit)) {
+                    while (!q.empty()) {
+                        tree.release(q.front().node);
+                        q.pop();
+                    }
+                    return false;
+                }
+                continue;
+            }
+            int limit = nexts.size();
+            for (int i = 0; i < limit - 1; ++i) {
+                RouteEntry new_entry = entry;
+                ++tree.refs[entry.node]; // the branch shares the prefix with entry
+                new_entry.push_back(nexts[i], tree, graph, segmented_lines);
+                q.push(std::move(new_entry));
+            }
+
+            entry.push_back(nexts.back(), tree, graph, segmented_lines);
+            q.push(std::move(entry));
+        }
+        return true;
+    }
+};
+
+// a line whose seeds start more routes than this is segmented automatically
+constexpr int auto_segmentation_route_count = 16;
+
+// count the routes starting from every unsegmented line before searching, and segment the lines
+// that would produce too many of them; repeats until no further line needs segmentation
+std::vector<int> apply_auto_segmentation(
+    const TrackGraph& graph, std::unordered_map<int, int>& segmented_lines,
+    const std::unordered_set<int>& lines_mask
+) {
+    const geometry::Map& geomap = graph.geomap;
+    std::vector<int> line_ids;
+    for (const auto& [line_id, line] : geomap.lines) {
+        if (!lines_mask.empty() && !lines_mask.contains(line_id)) continue;
+        if (line.point_ids.size() < 2 || line.is_simple) continue;
+        line_ids.push_back(line_id);
+    }
+    std::sort(line_ids.begin(), line_ids.end());
+
+    // segmenting a line only changes the counts of lines that can reach it, so after each round
+    // only those lines are counted again and the memoized counts of all other lines are kept
+    RouteCounter counter(graph, segmented_lines);
+    std::unordered_set<int> affected_lines(line_ids.begin(), line_ids.end());
+    std::vector<int> adjusted_lines;
+    while (true) {
+        std::vector<int> new_lines;
+        for (int line_id : line_ids) {
+            if (segmented_lines.contains(line_id)) continue;
+            if (!affected_lines.contains(line_id)) continue;
+            const auto& line = geomap.lines.at(line_id);
+            int route_count = 0;
+            for (int track_id : {
+                graph.find_track(line_id, 0, true),
+                graph.find_track(line_id, static_cast<int>(line.point_ids.size()) - 1, false)
+            }) {
+                if (track_id != -1) {
+                    route_count += counter.count_from(track_id);
+                }
+            }
+            if (route_count > auto_segmentation_route_count) {
+                new_lines.push_back(line_id);
+            }
+        }
+        if (new_lines.empty()) break;
+
+        for (int line_id : new_lines) {
+            segmented_lines[line_id] = std::min(
+                geomap.config.max_rc_steps << 1, geomap.config.max_rc_steps + 6
+            );
+            adjusted_lines.push_back(line_id);
+
+            // log adjustment
+            std::string name_disp = geomap.lines.at(line_id).name;
+            if (!name_disp.empty()) {
+                name_disp = " \"" + name_disp + "\"";
+            }
+            std::cout << "[INFO] Applying auto-segmentation (max_rc_steps: " << geomap.config.max_rc_steps << 
+                      ") to line # " << std::setw(4) << line_id << name_disp << '.' << std::endl;
+        }
+
+        affected_lines = graph.lines_reaching(new_lines);
+        counter.invalidate(affected_lines);
+    }
+    return adjusted_lines;
 }
 
+// cancels the searches of the optimizer once its time budget has run out; a budget of 0 never expires
+class CancellationToken {
+public:
+    explicit CancellationToken(int budget_ms) : 
+        has_deadline(budget_ms > 0),
+        deadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(budget_ms)) {}
+
+    bool cancelled() const {
+        if (expired) return true;
+        if (has_deadline && std::chrono::steady_clock::now() >= deadline) expired = true;
+        return expired;
+    }
+
+private:
+    bool has_deadline;
+    std::chrono::steady_clock::time_point deadline;
+    mutable std::atomic<bool> expired = false;
+};
+
+// enumerate the routes of all lines (or only the lines in lines_mask); the result does not depend on
+// the number of threads in pool: routes are merged seed by seed in a fixed order.
+// If cancellation is cancelled during the search, the result is incomplete and must be discarded.
+// With an incumbent_line_count, only the number of lines matters to the caller: the search may order
+// the seeds differently, and stops with at least that many lines once the count cannot stay below it
 std::unordered_map<int, rc::Line> get_lines(
-    const geometry::Map& geomap, const rc::Map& rcmap,
+    const TrackGraph& graph, ThreadPool& thread_pool, const rc::Map& rcmap,
     const std::unordered_map<int, int>& og_segmented_lines,
+    const std::unordered_map<int, int>& segment_offsets,
     const std::unordered_set<int>& lines_mask = {},
     int cutoff_line_count = 0,
-    std::vector<int>* extra_segmented_lines = nullptr
+    int incumbent_line_count = 0,
+    std::vector<int>* extra_segmented_lines = nullptr,
+    const CancellationToken* cancellation = nullptr
 ) {
-    std::unordered_map<int, rc::Line> lines;
+    const geometry::Map& geomap = graph.geomap;
+    RouteSet lines;
     std::unordered_map<int, int> new_segmented_lines;
 
+    // lines with too many routes are segmented before the search starts
     if (extra_segmented_lines) {
         new_segmented_lines = og_segmented_lines;
+        std::vector<int> adjusted_lines = apply_auto_segmentation(graph, new_segmented_lines, lines_mask);
+        extra_segmented_lines->insert(extra_segmented_lines->end(), adjusted_lines.begin(), adjusted_lines.end());
     }
 
     const std::unordered_map<int, int>& segmented_lines = 
         extra_segmented_lines ? new_segmented_lines : og_segmented_lines;
 
-    // pre-process point information
-    std::unordered_map<int, Point> points;
-    for (const auto& [point_id, point] : geomap.points) {
-        points[point_id] = static_cast<Point>(point);
-    }
-    for (const auto& [line_id, line] : geomap.lines) {
-        for (size_t i = 0; i < line.point_ids.size(); ++i) {
-            int pid = line.point_ids[i];
-            if (!points.contains(pid)) continue;
-            if (i + 1 < line.point_ids.size()) {
-                points[pid].tracks.push_back(Track{
-                    .point_id = pid,
-                    .line_id = line_id,
-                    .index_in_line = static_cast<int>(i),
-                    .forward = true
-                });
-            }
-            if (i > 0) {
-                points[pid].tracks.push_back(Track{
-                    .point_id = pid,
-                    .line_id = line_id,
-                    .index_in_line = static_cast<int>(i),
-                    .forward = false
-                });
-            }
-            if (i == 0 && !line.is_loop) {
-                points[pid].tracks.push_back(Track{
-                    .point_id = pid,
-                    .line_id = line_id,
-                    .index_in_line = static_cast<int>(i),
-                    .forward = false,
-                    .is_end = true
-                });
-            }
-            if (i + 1 == line.point_ids.size() && !line.is_loop) {
-                points[pid].tracks.push_back(Track{
-                    .point_id = pid,
-                    .line_id = line_id,
-                    .index_in_line = static_cast<int>(i),
-                    .forward = true,
-                    .is_end = true
-                });
-            }
+    // in batch mode, lines are only collected here and deduplicated all at once at the end;
+    // the line count is then unknown during the search, so the cutoff does not apply
+    bool batch = geomap.config.batch_deduplication;
+    std::vector<rc::Line> batch_lines;
+    auto emit_line = [&](rc::Line&& line) {
+        if (batch) {
+            batch_lines.push_back(std::move(line));
+        } else {
+            lines.add(std::move(line));
         }
-    }
+    };
 
     int cnt = 0;
-    auto add_line = [&](const std::vector<Track>& tracks) {
-        if (tracks.size() < 2) return;
+    auto add_line = [&](const auto& station_ids) {
         rc::Line line;
         line.id = ++cnt;
         line.is_loop = false;
-        for (const auto& track : tracks) {
-            if (!geomap.points.contains(track.point_id)) continue;
-            const auto& point = geomap.points.at(track.point_id);
-            if (point.type != geometry::Point::Type::Station) continue;
-            int id = geomap.point_to_group.contains(point.id) ? geomap.point_to_group.at(point.id)->id : point.id;
-            if (!geomap.config.merge_consecutive_duplicates || line.station_ids.empty() || line.station_ids.back() != id) {
-                line.station_ids.push_back(id);
-            }
-        }
-        add_and_remove_duplicate(lines, std::move(line));
+        line.station_ids.assign(station_ids.begin(), station_ids.end());
+        emit_line(std::move(line));
     };
 
-    auto next_tracks = [&](const Track& track) {
-        std::vector<Track> result;
-        if (track.is_end) return result;
-        int next_pid = geomap.lines.at(track.line_id).point_ids[track.get_next_index()];
-        for (const auto& t : points.at(next_pid).tracks) {
-            if (t.line_id == track.line_id && t.index_in_line == track.get_next_index()) {
-                if (t.forward == track.forward || t.is_end) {
-                    result.push_back(t);
-                }
-                continue;
-            }
-            if (t.is_end) continue;
-            bool is_friend = geomap.config.friend_lines.contains({track.line_id, t.line_id}) || 
-                             track.line_id == t.line_id;
-            bool is_merged = geomap.config.merged_lines.contains({track.line_id, t.line_id});
-            if (is_merged) {
-                result.push_back(t);
-                continue;
-            }
-            if (!is_friend) continue;
-            int pid_after_next = geomap.lines.at(t.line_id).point_ids[t.get_next_index()];
-            if (geomap.can_move_through(track.point_id, next_pid, pid_after_next)) {
-                result.push_back(t);
-            }
-        }
-        if (result.size() > 1) {
-            // remove the only one with is_end == true
-            result.erase(std::remove_if(result.begin(), result.end(), [](const Track& t) {
-                return t.is_end;
-            }), result.end());
-        }
-        return result;
-    };
-
-restart_search: // we need to restart search if auto-segmentation is applied
-
-    lines.clear();
-    int route_entry_cnt = 0;
-
-    // line id -> set of route ids that include this line
-    std::unordered_map<int, std::unordered_set<int>> line_routes; 
-  
-    // search possible routes
-    std::queue<RouteEntry> q;
+    // collect the starting tracks of all routes
+    std::vector<int> seeds;
     for (const auto& [line_id, line] : geomap.lines) {
         if (!lines_mask.empty() && !lines_mask.contains(line_id)) continue;
         if (line.point_ids.size() < 2) continue;
@@ -249,118 +398,141 @@ restart_search: // we need to restart search if auto-segmentation is applied
                     simple_line.station_ids.push_back(id);
                 }
             }
-            add_and_remove_duplicate(lines, std::move(simple_line));
+            emit_line(std::move(simple_line));
             continue;
         }
         
-        RouteEntry entry1;
-        entry1.id = ++route_entry_cnt;
-        entry1.push_back(Track(line.point_ids.front(), line_id, 0, true), geomap, segmented_lines);
-        if (!segmented_lines.contains(line_id)) {
-            line_routes[line_id].insert(entry1.id);
-        }
-        q.push(std::move(entry1));
-
-        RouteEntry entry2;
-        entry2.id = ++route_entry_cnt;
-        entry2.push_back(Track(
-            line.point_ids.back(), line_id, 
-            static_cast<int>(line.point_ids.size()) - 1, false), 
-            geomap, segmented_lines
-        );
-        if (!segmented_lines.contains(line_id)) {
-            line_routes[line_id].insert(entry2.id);
-        }
-        q.push(std::move(entry2));
+        auto add_seed = [&](int index_in_line, bool forward) {
+            int track_id = graph.find_track(line_id, index_in_line, forward);
+            if (track_id != -1) {
+                seeds.push_back(track_id);
+            }
+        };
+
+        add_seed(0, true);
+        add_seed(static_cast<int>(line.point_ids.size()) - 1, false);
 
         if (!segmented_lines.contains(line_id)) continue;
 
+        // segments start at every index i > 0 with i = offset (mod interval)
         int interval = segmented_lines.at(line_id) - geomap.config.max_rc_steps;
-        for (size_t i = interval; i + 1 < line.point_ids.size(); i += interval) {
-            RouteEntry entry3;
-            entry3.id = ++route_entry_cnt;
-            entry3.push_back(Track(line.point_ids[i], line_id, static_cast<int>(i), true), geomap, segmented_lines);
-            q.push(std::move(entry3));
-
-            RouteEntry entry4;
-            entry4.id = ++route_entry_cnt;
-            entry4.push_back(Track(line.point_ids[i], line_id, static_cast<int>(i), false), geomap, segmented_lines);
-            q.push(std::move(entry4));
+        int offset = segment_offsets.contains(line_id) ? segment_offsets.at(line_id) % interval : 0;
+        for (size_t i = offset > 0 ? offset : interval; i + 1 < line.point_ids.size(); i += interval) {
+            add_seed(static_cast<int>(i), true);
+            add_seed(static_cast<int>(i), false);
         }
     }
 
-    int counter = 0;
+    auto cutoff_reached = [&]() {
+        return !batch && cutoff_line_count > 0 && lines.size() >= static_cast<size_t>(cutoff_line_count);
+    };
+    auto cancelled = [&]() {
+        return cancellation && cancellation->cancelled();
+    };
 
-    // do breadth-first search; no need to track visited states as we care about all possible routes
-    while (!q.empty()) {
-        ++counter;
-        
-        // check every 256 iterations for segmentation adjustment
-        if (extra_segmented_lines && counter == 256) {
-            bool adjusted = false;
-            for (const auto& [line_id, route_ids] : line_routes) {
-                if (route_ids.size() > 16) {
-                    new_segmented_lines[line_id] = std::min(
-                        geomap.config.max_rc_steps << 1, geomap.config.max_rc_steps + 6
-                    );
-                    adjusted = true;
-                    if (extra_segmented_lines) {
-                        extra_segmented_lines->push_back(line_id);
-                    }
+    // branch and bound: a line can only be removed by a longer route, so once every remaining route
+    // is shorter than a line, that line is final. Seeds are searched longest possible route first,
+    // and the number of lines longer than the longest route of the current seed is a lower bound of
+    // the final count; the search stops as soon as that bound reaches the incumbent
+    bool bounded = !batch && incumbent_line_count > 0;
+    std::vector<int> seed_bounds; // most stations on a route of each seed
+    if (bounded) {
+        std::vector<std::pair<int, int>> bounded_seeds;
+        for (int seed : seeds) {
+            // every station after the first one uses up the budget
+            int budget = graph.remaining_after(unlimited_remaining_count, seed, segmented_lines);
+            bounded_seeds.emplace_back(std::min(graph.max_stations_from(seed), budget + 1), seed);
+        }
+        std::stable_sort(bounded_seeds.begin(), bounded_seeds.end(), [](const auto& a, const auto& b) {
+            return a.first > b.first;
+        });
+        for (size_t i = 0; i < seeds.size(); ++i) {
+            seed_bounds.push_back(bounded_seeds[i].first);
+            seeds[i] = bounded_seeds[i].second;
+        }
+    }
+    // whether the lines that no route of seeds[next_seed] or a later seed can remove reach the incumbent
+    auto bound_reached = [&](size_t next_seed) {
+        if (!bounded) return false;
+        size_t longest_route = next_seed < seeds.size() ? seed_bounds[next_seed] : 0;
+        return lines.count_longer_than(longest_route) >= static_cast<size_t>(incumbent_line_count);
+    };
 
-                    // log adjustment
-                    std::string name_disp = geomap.lines.at(line_id).name;
-                    if (!name_disp.empty()) {
-                        name_disp = " \"" + name_disp + "\"";
-                    }
-                    std::cout << "[INFO] Applying auto-segmentation (max_rc_steps: " << geomap.config.max_rc_steps << 
-                              ") to line # " << std::setw(4) << line_id << name_disp << '.' << std::endl;
-                }
-            }
-            if (adjusted) {
-                goto restart_search;
-            }
-            counter = 0;
+    if (thread_pool.size() == 1) {
+        // stream routes straight into the result
+        RouteSearch search(graph, segmented_lines);
+        for (size_t i = 0; i < seeds.size(); ++i) {
+            bool completed = search.run(seeds[i], [&](const std::pmr::vector<int>& station_ids) {
+                add_line(station_ids);
+                return !cutoff_reached() && !bound_reached(i) && !cancelled();
+            });
+            if (!completed || bound_reached(i + 1)) break;
+        }
+        if (batch && !cancelled()) {
+            lines.add_all(std::move(batch_lines), thread_pool);
         }
+        return lines.release();
+    }
 
-        RouteEntry entry = std::move(q.front());
-        q.pop();
-        const Track& last_track = entry.tracks.back();
-        std::vector<Track> nexts = next_tracks(last_track);
-        if (nexts.empty() || entry.full()) {
-            add_line(entry.tracks);
-            if (cutoff_line_count > 0 && lines.size() >= static_cast<size_t>(cutoff_line_count)) {
-                return lines;
+    // every seed is a task of the work-stealing pool; the routes of each seed are buffered
+    // and merged in seed order as soon as all earlier seeds have been merged
+    struct SeedRoutes {
+        std::vector<std::vector<int>> routes;
+        std::atomic<bool> done = false;
+    };
+    std::vector<SeedRoutes> seed_routes(seeds.size());
+    std::atomic<bool> stopped = false;
+    std::atomic<size_t> unfinished = seeds.size();
+
+    for (size_t i = 0; i < seeds.size(); ++i) {
+        thread_pool.submit([&, i]() {
+            if (!stopped) {
+                RouteSearch search(graph, segmented_lines);
+                search.run(seeds[i], [&](const std::pmr::vector<int>& station_ids) {
+                    seed_routes[i].routes.emplace_back(station_ids.begin(), station_ids.end());
+                    if (cancelled()) stopped = true;
+                    return !stopped.load();
+                });
             }
-            continue;
+            seed_routes[i].done = true;
+            --unfinished;
+        });
+    }
+
+    for (size_t i = 0; i < seeds.size() && !stopped; ++i) {
+        while (!seed_routes[i].done) {
+            if (!thread_pool.run_pending_task()) std::this_thread::yield();
+        }
+        if (cancelled()) {
+            stopped = true;
+            break;
         }
-        int limit = nexts.size();
-        for (int i = 0; i < limit - 1; ++i) {
-            // ignore updates to line_routes on this route copy to reduce complexity
-            // after all the line_routes are only for infinite loop detection
-            RouteEntry new_entry = entry;
-            new_entry.id = ++route_entry_cnt;
-
-            // this must update line_routes to avoid infinite loops
-            new_entry.push_back(nexts[i], geomap, segmented_lines);
-            if (!segmented_lines.contains(nexts[i].line_id)) {
-                line_routes[nexts[i].line_id].insert(new_entry.id);
+        for (const auto& route : seed_routes[i].routes) {
+            add_line(route);
+            if (cutoff_reached() || bound_reached(i)) {
+                stopped = true;
+                break;
             }
-
-            q.push(std::move(new_entry));
         }
+        seed_routes[i].routes = {};
+        if (bound_reached(i + 1)) stopped = true;
+    }
 
-        entry.push_back(nexts.back(), geomap, segmented_lines);
-        if (!segmented_lines.contains(nexts.back().line_id)) {
-            line_routes[nexts.back().line_id].insert(entry.id);
-        }
-        q.push(std::move(entry));
+    // the remaining tasks refer to local state, so wait until they have all returned
+    while (unfinished > 0) {
+        if (!thread_pool.run_pending_task()) std::this_thread::yield();
     }
 
-    return lines;
+    if (batch && !cancelled()) {
+        lines.add_all(std::move(batch_lines), thread_pool);
+    }
+    return lines.release();
 }
 
 void add_lines(const geometry::Map& geomap, rc::Map& rcmap) {
+    // the track graph and the thread pool are shared by the base search, every optimizer evaluation and the final pass
+    const TrackGraph graph(geomap);
+    ThreadPool thread_pool(geomap.config.threads);
     std::unordered_map<int, int> segmented_lines = geomap.config.segmented_lines;
     std::vector<int> adjusted_lines;
     std::unordered_map<int, rc::Line> base_lines;
@@ -370,7 +542,8 @@ void add_lines(const geometry::Map& geomap, rc::Map& rcmap) {
             seg_len = geomap.config.max_rc_steps << 1;
         }
     }
-    base_lines = get_lines(geomap, rcmap, segmented_lines, {}, 0, &adjusted_lines);
+    std::unordered_map<int, int> segment_offsets = geomap.config.segment_offsets;
+    base_lines = get_lines(graph, thread_pool, rcmap, segmented_lines, segment_offsets, {}, 0, 0, &adjusted_lines);
 
     if (!geomap.config.optimize_segmentation) {
         rcmap.lines = base_lines;
@@ -399,91 +572,397 @@ void add_lines(const geometry::Map& geomap, rc::Map& rcmap) {
         return;
     }
 
-    // Get all lines related to the groups via breadth-first search
-    std::unordered_set<int> lines_mask;
+    // Split the lines related to the groups into components connected by friend or merged lines;
+    // the lines of a group share one value, so they always end up in the same component.
+    // Routes never leave a component, so components are optimized separately, each on its own lines
+    std::unordered_map<int, int> line_groups;
     for (const auto& [group_key, line_ids] : seg_groups) {
-        lines_mask.insert(line_ids.begin(), line_ids.end());
+        for (int line_id : line_ids) {
+            line_groups[line_id] = group_key;
+        }
     }
-    
-    std::queue<int> q;
-    for (int line_id : lines_mask) {
-        q.push(line_id);
-    }
-    while (!q.empty()) {
-        int line_id = q.front();
-        q.pop();
-        for (const auto& [l1, l2] : geomap.config.friend_lines) {
-            if (l1 == line_id && !lines_mask.contains(l2)) {
-                lines_mask.insert(l2);
-                q.push(l2);
+
+    // the descent revisits many configurations, so line counts are cached by the segmentation
+    // length of every group; an evaluation that did not beat the best count may have been cut short,
+    // so its count is only a lower bound of the real one
+    struct CachedCount {
+        int count;
+        bool lower_bound;
+    };
+    struct GroupValuesHash {
+        size_t operator()(const std::vector<int>& values) const {
+            size_t h = values.size();
+            for (int v : values) {
+                h ^= std::hash<int>{}(v) + 0x9e3779b9 + (h << 6) + (h >> 2);
             }
+            return h;
         }
-        for (const auto& [l1, l2] : geomap.config.merged_lines) {
-            if (l1 == line_id && !lines_mask.contains(l2)) {
-                lines_mask.insert(l2);
-                q.push(l2);
+    };
+
+    struct Component {
+        std::unordered_set<int> lines_mask;
+        std::vector<int> group_keys; // in the order of seg_groups
+        std::unordered_map<int, int> seg_config;
+        std::unordered_map<int, int> offset_config;
+        std::unordered_map<std::vector<int>, CachedCount, GroupValuesHash> count_cache;
+        int line_count = -1; // -1 until the first evaluation has finished
+        int iteration_count = 0;
+        int evaluation_count = 0;
+        int cache_hit_count = 0;
+    };
+    std::vector<Component> components;
+    std::unordered_map<int, int> group_components;
+
+    for (const auto& [group_key, line_ids] : seg_groups) {
+        if (group_components.contains(group_key)) continue;
+        int component_index = static_cast<int>(components.size());
+        Component& component = components.emplace_back();
+
+        // Get all lines related to the group via breadth-first search
+        std::queue<int> q;
+        auto visit = [&](int line_id) {
+            if (component.lines_mask.insert(line_id).second) {
+                q.push(line_id);
+            }
+        };
+        auto visit_group = [&](int key) {
+            if (!group_components.emplace(key, component_index).second) return;
+            for (int line_id : seg_groups.at(key)) {
+                visit(line_id);
+            }
+        };
+        visit_group(group_key);
+        while (!q.empty()) {
+            int line_id = q.front();
+            q.pop();
+            if (line_groups.contains(line_id)) {
+                visit_group(line_groups.at(line_id));
+            }
+            if (auto it = geomap.config.line_friends.find(line_id); it != geomap.config.line_friends.end()) {
+                for (int friend_id : it->second) visit(friend_id);
+            }
+            if (auto it = geomap.config.line_merges.find(line_id); it != geomap.config.line_merges.end()) {
+                for (int merged_id : it->second) visit(merged_id);
             }
         }
     }
+    for (const auto& [group_key, line_ids] : seg_groups) {
+        components[group_components.at(group_key)].group_keys.push_back(group_key);
+    }
 
-    // stochastic descent to optimize the number of lines
+    // the optimizer always keeps the best configuration found so far; once the time budget has run out,
+    // the running evaluations are abandoned and that configuration is used
+    const CancellationToken cancellation(geomap.config.optimize_time_budget_ms);
+    auto start_time = std::chrono::steady_clock::now();
 
-    auto get_line_count = [&](const std::unordered_map<int, int>& seg_config, int best) {
-        auto temp_lines = get_lines(geomap, rcmap, seg_config, lines_mask, best << 1);
-        return static_cast<int>(temp_lines.size());
+    // the segmentation of a group: its segment length and the offset of its segment starts
+    struct Segmentation {
+        int length;
+        int offset;
     };
 
-    int current_count = get_line_count(segmented_lines, 0);
-    bool improved = true;
-    int max_iterations = geomap.config.max_iterations;
-    int iteration = 0;
+    // stochastic descent to optimize the number of lines
+    auto optimize_component = [&](Component& component) {
+        std::unordered_map<int, int>& seg_config = component.seg_config;
+        std::unordered_map<int, int>& offset_config = component.offset_config;
+        seg_config = segmented_lines;
+        offset_config = segment_offsets;
+
+        // INT_MAX if the evaluation was cancelled
+        auto get_line_count = [&](const std::unordered_map<int, int>& config, 
+                                  const std::unordered_map<int, int>& offsets, int best) {
+            auto temp_lines = get_lines(
+                graph, thread_pool, rcmap, config, offsets, component.lines_mask, best << 1, best, nullptr, &cancellation
+            );
+            if (cancellation.cancelled()) return INT_MAX;
+            return static_cast<int>(temp_lines.size());
+        };
 
-    while (improved && iteration < max_iterations) {
-        improved = false;
-        ++iteration;
-        
-        const std::vector<int> deltas = iteration < 3 ? 
-            std::vector<int>{-11, -5, -2, 2, 5, 11} : 
-            std::vector<int>{-5, -2, 2, 5};
-
-        // Iterate over each group (each group shares the same segmentation length)
-        for (const auto& [group_key, line_ids] : seg_groups) {
-            // All lines in this group share the same segmentation length
-            int current_val = segmented_lines[line_ids.front()];
-            int best_val = current_val;
-            int best_count = current_count;
-
-            for (int delta : deltas) {
-                int new_val = current_val + delta;
-                // Ensure the value stays within reasonable bounds
-                if (new_val <= geomap.config.max_rc_steps) continue;
-                if (new_val >= geomap.config.max_length) continue;
-
-                auto temp_config = segmented_lines;
+        auto group_offset = [](const std::unordered_map<int, int>& offsets, int line_id) {
+            return offsets.contains(line_id) ? offsets.at(line_id) : 0;
+        };
+
+        auto group_values = [&](const std::unordered_map<int, int>& config, const std::unordered_map<int, int>& offsets) {
+            std::vector<int> values;
+            for (int group_key : component.group_keys) {
+                int line_id = seg_groups.at(group_key).front();
+                values.push_back(config.at(line_id));
+                values.push_back(group_offset(offsets, line_id));
+            }
+            return values;
+        };
+
+        // a cached count is good enough if it is exact or still does not beat the best count
+        auto find_cached_count = [&](const std::vector<int>& values, int best) -> const CachedCount* {
+            auto it = component.count_cache.find(values);
+            if (it == component.count_cache.end()) return nullptr;
+            if (it->second.lower_bound && (best == 0 || it->second.count < best)) return nullptr;
+            return &it->second;
+        };
+
+        auto store_count = [&](std::vector<int>&& values, int count, int best) {
+            ++component.evaluation_count;
+            component.count_cache[std::move(values)] = {count, best > 0 && count >= best};
+        };
+
+        int current_count = get_line_count(seg_config, offset_config, 0);
+        if (current_count == INT_MAX) return;
+        store_count(group_values(seg_config, offset_config), current_count, 0);
+        component.line_count = current_count;
+
+        // count the lines with the group set to each of vals; the values are evaluated concurrently.
+        // Every count above the cutoff loses anyway, so the cutoff of the current count gives the
+        // same choice as evaluating them in turn
+        auto evaluate_group = [&](const std::vector<int>& line_ids, const std::vector<Segmentation>& vals) {
+            std::vector<int> counts(vals.size());
+            std::vector<std::unordered_map<int, int>> configs(vals.size());
+            std::vector<std::unordered_map<int, int>> offsets(vals.size());
+            std::vector<std::vector<int>> keys(vals.size());
+            std::vector<int> uncached;
+            for (size_t k = 0; k < vals.size(); ++k) {
+                configs[k] = seg_config;
+                offsets[k] = offset_config;
                 // Update all lines in this group with the same value
                 for (int line_id : line_ids) {
-                    temp_config[line_id] = new_val;
+                    configs[k][line_id] = vals[k].length;
+                    offsets[k][line_id] = vals[k].offset;
                 }
-                int new_count = get_line_count(temp_config, best_count);
+                keys[k] = group_values(configs[k], offsets[k]);
+                if (const CachedCount* cached = find_cached_count(keys[k], current_count)) {
+                    counts[k] = cached->count;
+                    ++component.cache_hit_count;
+                } else {
+                    uncached.push_back(static_cast<int>(k));
+                }
+            }
+            thread_pool.parallel_for(static_cast<int>(uncached.size()), [&](int u) {
+                int k = uncached[u];
+                counts[k] = get_line_count(configs[k], offsets[k], current_count);
+            });
+            for (int k : uncached) {
+                if (counts[k] == INT_MAX) continue;
+                store_count(std::move(keys[k]), counts[k], current_count);
+            }
+            return counts;
+        };
 
-                if (new_count < best_count) {
-                    best_count = new_count;
-                    best_val = new_val;
-                    improved = true;
+        // golden-section search over the useful range of values, used in the first round: a coarse grid
+        // locates the best region, golden-section steps narrow it down and every value in the final
+        // bracket is tried. The count is not unimodal in general, so the best value seen anywhere is kept
+        const int search_lo = geomap.config.max_rc_steps + 1;
+        const int search_hi = std::min(geomap.config.max_length - 1, geomap.config.max_rc_steps << 2);
+        auto golden_search = [&](const std::vector<int>& line_ids, Segmentation current, 
+                                 std::vector<Segmentation>& vals, std::vector<int>& counts) {
+            int current_val = current.length;
+            std::unordered_map<int, int> seen;
+            seen[current_val] = current_count;
+            auto probe = [&](const std::vector<int>& probe_vals) {
+                std::vector<Segmentation> new_vals;
+                for (int v : probe_vals) {
+                    if (v < search_lo || v > search_hi || seen.contains(v)) continue;
+                    if (std::any_of(new_vals.begin(), new_vals.end(), [&](const Segmentation& c) { 
+                        return c.length == v; 
+                    })) continue;
+                    new_vals.push_back({v, current.offset});
+                }
+                std::vector<int> new_counts = evaluate_group(line_ids, new_vals);
+                for (size_t k = 0; k < new_vals.size(); ++k) {
+                    seen[new_vals[k].length] = new_counts[k];
+                    vals.push_back(new_vals[k]);
+                    counts.push_back(new_counts[k]);
                 }
+            };
+            if (search_lo > search_hi) return;
+
+            constexpr int grid_points = 5;
+            std::vector<int> grid;
+            for (int k = 0; k < grid_points; ++k) {
+                grid.push_back(search_lo + (search_hi - search_lo) * k / (grid_points - 1));
             }
+            probe(grid);
+            if (cancellation.cancelled()) return;
 
-            if (best_val != current_val) {
-                // Update all lines in this group with the best value
-                for (int line_id : line_ids) {
-                    segmented_lines[line_id] = best_val;
+            // bracket the best grid value (or the current value) by its neighbours on the grid
+            int center = current_val;
+            for (int v : grid) {
+                if (seen.at(v) < seen.at(center)) center = v;
+            }
+            int a = search_lo;
+            int b = search_hi;
+            for (int v : grid) {
+                if (v < center) a = std::max(a, v);
+                if (v > center) b = std::min(b, v);
+            }
+
+            constexpr double golden_ratio = 0.6180339887498949;
+            while (b - a > 3 && !cancellation.cancelled()) {
+                int step = static_cast<int>(std::lround((b - a) * golden_ratio));
+                int x1 = b - step;
+                int x2 = a + step;
+                if (x1 >= x2) break;
+                probe({x1, x2});
+                if (!seen.contains(x1) || !seen.contains(x2)) break;
+                if (seen.at(x1) <= seen.at(x2)) {
+                    b = x2;
+                } else {
+                    a = x1;
+                }
+            }
+            if (cancellation.cancelled()) return;
+
+            std::vector<int> bracket;
+            for (int v = a; v <= b; ++v) {
+                bracket.push_back(v);
+            }
+            probe(bracket);
+        };
+
+        bool improved = true;
+        int max_iterations = geomap.config.max_iterations;
+        int iteration = 0;
+
+        while (improved && iteration < max_iterations && !cancellation.cancelled()) {
+            improved = false;
+            ++iteration;
+            component.iteration_count = iteration;
+            
+            const std::vector<int> deltas = iteration < 3 ? 
+                std::vector<int>{-11, -5, -2, 2, 5, 11} : 
+                std::vector<int>{-5, -2, 2, 5};
+            auto delta_candidates = [&](Segmentation current) {
+                std::vector<Segmentation> vals;
+                for (int delta : deltas) {
+                    int new_val = current.length + delta;
+                    // Ensure the value stays within reasonable bounds
+                    if (new_val <= geomap.config.max_rc_steps) continue;
+                    if (new_val >= geomap.config.max_length) continue;
+                    vals.push_back({new_val, current.offset});
+                }
+                return vals;
+            };
+            // shifts of the segment starts by a few points and by fractions of the interval
+            auto offset_candidates = [&](Segmentation current, std::vector<Segmentation>& vals) {
+                int interval = current.length - geomap.config.max_rc_steps;
+                for (int shift : {-1, 1, interval / 4, interval / 2, -interval / 4}) {
+                    int new_offset = ((current.offset + shift) % interval + interval) % interval;
+                    if (new_offset == current.offset % interval) continue;
+                    if (std::any_of(vals.begin(), vals.end(), [&](const Segmentation& c) {
+                        return c.length == current.length && c.offset == new_offset;
+                    })) continue;
+                    vals.push_back({current.length, new_offset});
+                }
+            };
+
+            // Iterate over each group (each group shares the same segmentation length and offset)
+            for (int group_key : component.group_keys) {
+                if (cancellation.cancelled()) break;
+                const std::vector<int>& line_ids = seg_groups.at(group_key);
+                // All lines in this group share the same segmentation length
+                Segmentation current{seg_config[line_ids.front()], group_offset(offset_config, line_ids.front())};
+                int best_index = -1;
+                int best_count = current_count;
+
+                std::vector<Segmentation> candidate_vals;
+                std::vector<int> candidate_counts;
+                if (geomap.config.optimize_strategy == geometry::Map::Config::OptimizeStrategy::GoldenSection && 
+                    iteration == 1) {
+                    golden_search(line_ids, current, candidate_vals, candidate_counts);
+                } else {
+                    // later rounds only follow the other groups, which have moved since, as in the descent
+                    candidate_vals = delta_candidates(current);
+                    candidate_counts = evaluate_group(line_ids, candidate_vals);
+                }
+
+                // the offsets are only moved when no length helps; offsets pinned by the config are kept
+                bool length_improves = std::any_of(candidate_counts.begin(), candidate_counts.end(), [&](int count) {
+                    return count < current_count;
+                });
+                bool offset_pinned = std::any_of(line_ids.begin(), line_ids.end(), [&](int line_id) {
+                    return geomap.config.segment_offsets.contains(line_id);
+                });
+                if (!length_improves && !offset_pinned && !cancellation.cancelled()) {
+                    std::vector<Segmentation> offset_vals;
+                    offset_candidates(current, offset_vals);
+                    std::vector<int> offset_counts = evaluate_group(line_ids, offset_vals);
+                    candidate_vals.insert(candidate_vals.end(), offset_vals.begin(), offset_vals.end());
+                    candidate_counts.insert(candidate_counts.end(), offset_counts.begin(), offset_counts.end());
+                }
+
+                // lowest count wins, ties go to the earlier candidate
+                for (size_t k = 0; k < candidate_vals.size(); ++k) {
+                    if (candidate_counts[k] < best_count) {
+                        best_count = candidate_counts[k];
+                        best_index = static_cast<int>(k);
+                        improved = true;
+                    }
+                }
+
+                if (best_index != -1) {
+                    // Update all lines in this group with the best value
+                    for (int line_id : line_ids) {
+                        seg_config[line_id] = candidate_vals[best_index].length;
+                        offset_config[line_id] = candidate_vals[best_index].offset;
+                    }
+                    current_count = best_count;
+                    component.line_count = current_count;
                 }
-                current_count = best_count;
             }
         }
+    };
+
+    thread_pool.parallel_for(static_cast<int>(components.size()), [&](int c) {
+        optimize_component(components[c]);
+    });
+
+    int line_count = 0;
+    int evaluation_count = 0;
+    int cache_hit_count = 0;
+    int unevaluated_count = 0;
+    for (const Component& component : components) {
+        for (int group_key : component.group_keys) {
+            for (int line_id : seg_groups.at(group_key)) {
+                segmented_lines[line_id] = component.seg_config.at(line_id);
+                if (component.offset_config.contains(line_id)) {
+                    segment_offsets[line_id] = component.offset_config.at(line_id);
+                }
+            }
+        }
+        if (component.line_count < 0) {
+            ++unevaluated_count;
+        } else {
+            line_count += component.line_count;
+        }
+        evaluation_count += component.evaluation_count;
+        cache_hit_count += component.cache_hit_count;
+    }
+
+    auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+    if (cancellation.cancelled()) {
+        std::cout << "[INFO] Segmentation optimization stopped after " << elapsed_ms << 
+            " ms (time budget: " << geomap.config.optimize_time_budget_ms << " ms); keeping the best segmentation found" << std::endl;
+        for (size_t c = 0; c < components.size(); ++c) {
+            const Component& component = components[c];
+            std::cout << "[INFO]   component " << c + 1 << "/" << components.size() << ": ";
+            if (component.line_count < 0) {
+                std::cout << "not evaluated" << std::endl;
+            } else {
+                std::cout << component.line_count << " lines after " << component.iteration_count << 
+                    " of at most " << geomap.config.max_iterations << " iterations" << std::endl;
+            }
+        }
+    }
+    std::cout << "[INFO] Segmentation optimized (" << 
+        (geomap.config.optimize_strategy == geometry::Map::Config::OptimizeStrategy::GoldenSection ? 
+            "GoldenSection" : "Descent") << ") in " << components.size() << " components to " << 
+        line_count << " lines";
+    if (unevaluated_count > 0) {
+        std::cout << " (" << unevaluated_count << " components not evaluated)";
     }
+    std::cout << " with " << evaluation_count << " evaluations, " << cache_hit_count << " cache hits in " << 
+        elapsed_ms << " ms" << std::endl;
 
-    rcmap.lines = get_lines(geomap, rcmap, segmented_lines);
+    rcmap.lines = get_lines(graph, thread_pool, rcmap, segmented_lines, segment_offsets);
 }
 
 void remove_orphaned_stations(rc::Map& rcmap) {
@@ -1,5 +1,7 @@
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <iostream>
 
 #include "geometry.h"
 
@@ -622,59 +624,121 @@ Position Map::normalized_pos(const Position& pos) const {
     return {pos.x / width, pos.y / height};
 }
 
+// Disjoint sets of stations (union by size, path compression), from which the station groups are
+// built once all stations have been joined. Every set with more than one station becomes a group.
+// A group keeps the id of the group of the first station when two groups are joined, or of the only
+// grouped station, or else the id of the first station; the stations of a group are kept in the
+// order they joined it.
+struct StationSets {
+    std::unordered_map<int, int> point_index; // point id -> index in the vectors below
+    std::vector<int> point_ids;
+    std::vector<int> parent;
+    std::vector<int> set_size;
+    std::vector<int> group_id; // of each root
+    std::vector<int> head; // first station of each root
+    std::vector<int> tail; // last station of each root
+    std::vector<int> next; // next station in the same set, or -1
+
+    int index_of(int point_id) {
+        auto [it, inserted] = point_index.try_emplace(point_id, static_cast<int>(point_ids.size()));
+        if (inserted) {
+            int i = it->second;
+            point_ids.push_back(point_id);
+            parent.push_back(i);
+            set_size.push_back(1);
+            group_id.push_back(point_id);
+            head.push_back(i);
+            tail.push_back(i);
+            next.push_back(-1);
+        }
+        return it->second;
+    }
+
+    int find(int i) {
+        int root = i;
+        while (parent[root] != root) root = parent[root];
+        while (parent[i] != root) {
+            int up = parent[i];
+            parent[i] = root;
+            i = up;
+        }
+        return root;
+    }
+
+    void join(int station1_id, int station2_id) {
+        if (station1_id == station2_id) return;
+        int a = find(index_of(station1_id));
+        int b = find(index_of(station2_id));
+        if (a == b) return;
+
+        int id = set_size[a] > 1 ? group_id[a] : set_size[b] > 1 ? group_id[b] : station1_id;
+        // a single station joins at the end of an existing group
+        int first = set_size[a] == 1 && set_size[b] > 1 ? b : a;
+        int second = first == a ? b : a;
+        next[tail[first]] = head[second];
+        int new_head = head[first];
+        int new_tail = tail[second];
+
+        if (set_size[a] < set_size[b]) std::swap(a, b);
+        parent[b] = a;
+        set_size[a] += set_size[b];
+        group_id[a] = id;
+        head[a] = new_head;
+        tail[a] = new_tail;
+    }
+
+    void build_groups(
+        std::unordered_map<int, StationGroup>& station_groups,
+        std::unordered_map<int, StationGroup*>& point_to_group
+    ) {
+        // groups are created in the order their first station joined a set
+        std::vector<char> built(point_ids.size());
+        for (int i = 0; i < static_cast<int>(point_ids.size()); ++i) {
+            int root = find(i);
+            if (set_size[root] < 2 || built[root]) continue;
+            built[root] = true;
+            StationGroup group;
+            group.id = group_id[root];
+            group.name = "Station Group " + std::to_string(group.id);
+            for (int j = head[root]; j != -1; j = next[j]) {
+                group.station_ids.push_back(point_ids[j]);
+            }
+            station_groups[group.id] = std::move(group);
+        }
+        for (int i = 0; i < static_cast<int>(point_ids.size()); ++i) {
+            int root = find(i);
+            if (set_size[root] < 2) continue;
+            point_to_group[point_ids[i]] = &station_groups.at(group_id[root]);
+        }
+    }
+};
+
 Map::Map(const nlohmann::json& aarc, const nlohmann::json& config_json) {
     int max_line_id = 0;
 
     // helper lambdas
     auto connect_lines = [&](int line1_id, int line2_id, bool forced = false) {
         if (line1_id == line2_id && !forced) return;
-        config.friend_lines.insert({line1_id, line2_id});
-        config.friend_lines.insert({line2_id, line1_id});
+        if (config.friend_lines.insert({line1_id, line2_id}).second) {
+            config.line_friends[line1_id].push_back(line2_id);
+        }
+        if (config.friend_lines.insert({line2_id, line1_id}).second) {
+            config.line_friends[line2_id].push_back(line1_id);
+        }
     };
 
     auto merge_lines = [&](int line1_id, int line2_id, bool forced = false) {
         if (line1_id == line2_id && !forced) return;
-        config.merged_lines.insert({line1_id, line2_id});
-        config.merged_lines.insert({line2_id, line1_id});
-    };
-
-    auto join_stations = [&](int station1_id, int station2_id) {
-        if (station1_id == station2_id) return;
-        auto it1 = point_to_group.find(station1_id);
-        auto it2 = point_to_group.find(station2_id);
-        if (it1 != point_to_group.end() && it2 != point_to_group.end()) {
-            if (it1->second == it2->second) return;
-            // merge groups
-            StationGroup* group1 = it1->second;
-            StationGroup* group2 = it2->second;
-            for (int sid : group2->station_ids) {
-                group1->station_ids.push_back(sid);
-                point_to_group[sid] = group1;
-            }
-            station_groups.erase(group2->id);
-        } else if (it1 != point_to_group.end()) {
-            // add to existing group
-            StationGroup* group = it1->second;
-            group->station_ids.push_back(station2_id);
-            point_to_group[station2_id] = group;
-        } else if (it2 != point_to_group.end()) {
-            // add to existing group
-            StationGroup* group = it2->second;
-            group->station_ids.push_back(station1_id);
-            point_to_group[station1_id] = group;
-        } else {
-            // create new group
-            int new_group_id = station1_id;
-            StationGroup new_group;
-            new_group.id = new_group_id;
-            new_group.name = "Station Group " + std::to_string(new_group_id);
-            new_group.station_ids = {station1_id, station2_id};
-            station_groups[new_group_id] = new_group;
-            point_to_group[station1_id] = &station_groups[new_group_id];
-            point_to_group[station2_id] = &station_groups[new_group_id];
+        if (config.merged_lines.insert({line1_id, line2_id}).second) {
+            config.line_merges[line1_id].push_back(line2_id);
+        }
+        if (config.merged_lines.insert({line2_id, line1_id}).second) {
+            config.line_merges[line2_id].push_back(line1_id);
         }
     };
 
+    StationSets station_sets;
+
     // load dimensions
     if (aarc.contains("cvsSize")) {
         width = aarc["cvsSize"][0].get<double>();
@@ -822,12 +886,31 @@ Map::Map(const nlohmann::json& aarc, const nlohmann::json& config_json) {
             config.max_iterations = max_iterations;
         }
     }
+    if (config_json.contains("optimize_time_budget_ms")) {
+        int budget = config_json["optimize_time_budget_ms"].get<int>();
+        if (budget > 0) {
+            config.optimize_time_budget_ms = budget;
+        }
+    }
+    if (config_json.contains("optimize_strategy")) {
+        std::string strategy_str = config_json["optimize_strategy"].get<std::string>();
+        if (strategy_str == "Descent") config.optimize_strategy = Config::OptimizeStrategy::Descent;
+        else if (strategy_str == "GoldenSection") config.optimize_strategy = Config::OptimizeStrategy::GoldenSection;
+    }
     if (config_json.contains("merge_consecutive_duplicates")) {
         config.merge_consecutive_duplicates = config_json["merge_consecutive_duplicates"].get<bool>();
     }
     if (config_json.contains("optimize_segmentation")) {
         config.optimize_segmentation = config_json["optimize_segmentation"].get<bool>();
     }
+    if (config_json.contains("batch_deduplication")) {
+        config.batch_deduplication = config_json["batch_deduplication"].get<bool>();
+    }
+    if (config_json.contains("search_mode")) {
+        std::string mode_str = config_json["search_mode"].get<std::string>();
+        if (mode_str == "BreadthFirst") config.search_mode = Config::SearchMode::BreadthFirst;
+        else if (mode_str == "DepthFirst") config.search_mode = Config::SearchMode::DepthFirst;
+    }
 
     if (config_json.contains("link_modes")) {
         for (auto& [key, value] : config_json["link_modes"].items()) {
@@ -850,26 +933,37 @@ Map::Map(const nlohmann::json& aarc, const nlohmann::json& config_json) {
         }
     }
 
+    // line name -> line id, built once for all the config entries below;
+    // if several lines share a name, the one with the smallest id is used
+    std::unordered_map<std::string, int> line_ids_by_name;
+    for (const auto& [id, line] : lines) {
+        auto [it, inserted] = line_ids_by_name.emplace(line.name, id);
+        if (!inserted && id < it->second) it->second = id;
+    }
+    // names and ids that match no line, reported together after the config is read
+    std::vector<std::string> unresolved_lines;
+    // a line given as a string (line name) or int (line id); -1 if there is no such line
+    auto resolve_line = [&](const nlohmann::json& entry) {
+        if (entry.is_string()) {
+            std::string name = entry.get<std::string>();
+            auto it = line_ids_by_name.find(name);
+            if (it != line_ids_by_name.end()) return it->second;
+            unresolved_lines.push_back("\"" + name + "\"");
+        } else if (entry.is_number_integer()) {
+            int id = entry.get<int>();
+            if (lines.find(id) != lines.end()) return id;
+            unresolved_lines.push_back(std::to_string(id));
+        }
+        return -1;
+    };
+
     if (config_json.contains("friend_lines")) {
         for (const auto& pair : config_json["friend_lines"]) {
             if (pair.size() != 2) continue;
             // the pair contains two entries, each of which can be a string (line name) or int (line id)
-            int line_ids[2] = {-1, -1};
+            int line_ids[2];
             for (int i = 0; i < 2; ++i) {
-                if (pair[i].is_string()) {
-                    std::string name = pair[i].get<std::string>();
-                    for (const auto& [id, line] : lines) {
-                        if (line.name == name) {
-                            line_ids[i] = id;
-                            break;
-                        }
-                    }
-                } else if (pair[i].is_number_integer()) {
-                    int id = pair[i].get<int>();
-                    if (lines.find(id) != lines.end()) {
-                        line_ids[i] = id;
-                    }
-                }
+                line_ids[i] = resolve_line(pair[i]);
             }
             if (line_ids[0] != -1 && line_ids[1] != -1) {
                 connect_lines(line_ids[0], line_ids[1], true);
@@ -881,22 +975,9 @@ Map::Map(const nlohmann::json& aarc, const nlohmann::json& config_json) {
         for (const auto& pair : config_json["merged_lines"]) {
             if (pair.size() != 2) continue;
             // the pair contains two entries, each of which can be a string (line name) or int (line id)
-            int line_ids[2] = {-1, -1};
+            int line_ids[2];
             for (int i = 0; i < 2; ++i) {
-                if (pair[i].is_string()) {
-                    std::string name = pair[i].get<std::string>();
-                    for (const auto& [id, line] : lines) {
-                        if (line.name == name) {
-                            line_ids[i] = id;
-                            break;
-                        }
-                    }
-                } else if (pair[i].is_number_integer()) {
-                    int id = pair[i].get<int>();
-                    if (lines.find(id) != lines.end()) {
-                        line_ids[i] = id;
-                    }
-                }
+                line_ids[i] = resolve_line(pair[i]);
             }
             if (line_ids[0] != -1 && line_ids[1] != -1) {
                 merge_lines(line_ids[0], line_ids[1], true);
@@ -910,45 +991,15 @@ Map::Map(const nlohmann::json& aarc, const nlohmann::json& config_json) {
             ++param_ind;
             if (entry.is_array()) {
                 for (const auto& sub_entry : entry) {
-                    if (sub_entry.is_string() || sub_entry.is_number_integer()) {
-                        int line_id = -1;
-                        if (sub_entry.is_string()) {
-                            std::string name = sub_entry.get<std::string>();
-                            for (const auto& [id, line] : lines) {
-                                if (line.name == name) {
-                                    line_id = id;
-                                    break;
-                                }
-                            }
-                        } else if (sub_entry.is_number_integer()) {
-                            int id = sub_entry.get<int>();
-                            if (lines.find(id) != lines.end()) {
-                                line_id = id;
-                            }
-                        }
-                        if (line_id != -1) {
-                            config.segmented_lines[line_id] = -param_ind;
-                        }
+                    int line_id = resolve_line(sub_entry);
+                    if (line_id != -1) {
+                        config.segmented_lines[line_id] = -param_ind;
                     }
                 }
                 continue;
             }
             if (entry.is_string() || entry.is_number_integer()) {
-                int line_id = -1;
-                if (entry.is_string()) {
-                    std::string name = entry.get<std::string>();
-                    for (const auto& [id, line] : lines) {
-                        if (line.name == name) {
-                            line_id = id;
-                            break;
-                        }
-                    }
-                } else if (entry.is_number_integer()) {
-                    int id = entry.get<int>();
-                    if (lines.find(id) != lines.end()) {
-                        line_id = id;
-                    }
-                }
+                int line_id = resolve_line(entry);
                 if (line_id != -1) {
                     config.segmented_lines[line_id] = -param_ind;
                 }
@@ -962,40 +1013,44 @@ Map::Map(const nlohmann::json& aarc, const nlohmann::json& config_json) {
                     seg_len = seg_len1;
                 }
             }
-            if (entry.contains("line") && entry["line"].is_string()) {
-                std::string name = entry["line"].get<std::string>();
-                for (const auto& [id, line] : lines) {
-                    if (line.name == name) {
-                        config.segmented_lines[id] = seg_len;
-                        break;
-                    }
+            // segments start at the indices of the line equal to segment_offset modulo the interval
+            int seg_offset = -1;
+            if (entry.contains("segment_offset")) {
+                int seg_offset1 = entry["segment_offset"].get<int>();
+                if (seg_offset1 >= 0) {
+                    seg_offset = seg_offset1;
                 }
-            } else if (entry.contains("line") && entry["line"].is_number_integer()) {
-                int id = entry["line"].get<int>();
-                if (lines.find(id) != lines.end()) {
-                    config.segmented_lines[id] = seg_len;
+            }
+            auto segment_line = [&](int id) {
+                config.segmented_lines[id] = seg_len;
+                if (seg_offset >= 0) {
+                    config.segment_offsets[id] = seg_offset;
+                }
+            };
+            if (entry.contains("line")) {
+                int line_id = resolve_line(entry["line"]);
+                if (line_id != -1) {
+                    segment_line(line_id);
                 }
             } else if (entry.contains("lines") && entry["lines"].is_array()) {
                 for (const auto& sub_entry : entry["lines"]) {
-                    if (sub_entry.is_string()) {
-                        std::string name = sub_entry.get<std::string>();
-                        for (const auto& [id, line] : lines) {
-                            if (line.name == name) {
-                                config.segmented_lines[id] = seg_len;
-                                break;
-                            }
-                        }
-                    } else if (sub_entry.is_number_integer()) {
-                        int id = sub_entry.get<int>();
-                        if (lines.find(id) != lines.end()) {
-                            config.segmented_lines[id] = seg_len;
-                        }
+                    int line_id = resolve_line(sub_entry);
+                    if (line_id != -1) {
+                        segment_line(line_id);
                     }
                 }
             }
         }
     }
 
+    if (!unresolved_lines.empty()) {
+        std::cout << "[WARN] " << unresolved_lines.size() << " line(s) in the config not found in the input:";
+        for (const auto& line : unresolved_lines) {
+            std::cout << " " << line;
+        }
+        std::cout << std::endl;
+    }
+
     // add auxiliary points
     add_auxiliary_points(*this);
 
@@ -1017,33 +1072,83 @@ Map::Map(const nlohmann::json& aarc, const nlohmann::json& config_json) {
                 lines[l.id] = std::move(l);
             }
             if (mode == Config::LinkMode::Group) {
-                join_stations(p1_id, p2_id);
+                station_sets.join(p1_id, p2_id);
             }
         }
     }
 
     // group nearby stations
-    for (const auto& [id1, p1] : points) {
-        if (p1.type != Point::Type::Station) continue;
-        for (const auto& [id2, p2] : points) {
-            if (id1 >= id2) continue;
-            if (p2.type != Point::Type::Station) continue;
-            double group_distance = config.auto_group_distance;
-            group_distance *= (p1.size + p2.size) / 2.0;
-            if ((p1.pos - p2.pos).length() <= group_distance + 1e-3) {
-                join_stations(id1, id2);
+    // stations are bucketed in a uniform grid whose cells are as large as the largest possible
+    // group distance, so only stations in the same or adjacent cells can be grouped; the pairs
+    // are joined in the order of a scan over all pairs of points, which keeps the groups the same
+    {
+        double max_size = 0.0;
+        std::unordered_map<int, int> point_rank; // point id -> position in the iteration order of points
+        for (const auto& [id, p] : points) {
+            point_rank[id] = static_cast<int>(point_rank.size());
+            if (p.type == Point::Type::Station) max_size = std::max(max_size, p.size);
+        }
+        double cell_size = std::max(config.auto_group_distance * max_size + 1e-3, 1e-3);
+        auto cell_of = [&](const Position& pos) {
+            return std::pair<long long, long long>{
+                static_cast<long long>(std::floor(pos.x / cell_size)),
+                static_cast<long long>(std::floor(pos.y / cell_size))
+            };
+        };
+        auto cell_key = [](long long cx, long long cy) {
+            return (static_cast<std::uint64_t>(cx) << 32) ^ static_cast<std::uint32_t>(cy);
+        };
+
+        std::unordered_map<std::uint64_t, std::vector<int>> cells;
+        for (const auto& [id, p] : points) {
+            if (p.type != Point::Type::Station) continue;
+            auto [cx, cy] = cell_of(p.pos);
+            cells[cell_key(cx, cy)].push_back(id);
+        }
+
+        std::vector<int> nearby;
+        for (const auto& [id1, p1] : points) {
+            if (p1.type != Point::Type::Station) continue;
+            nearby.clear();
+            auto [cx, cy] = cell_of(p1.pos);
+            for (long long dx = -1; dx <= 1; ++dx) {
+                for (long long dy = -1; dy <= 1; ++dy) {
+                    auto it = cells.find(cell_key(cx + dx, cy + dy));
+                    if (it == cells.end()) continue;
+                    for (int id2 : it->second) {
+                        if (id1 >= id2) continue;
+                        const Point& p2 = points.at(id2);
+                        double group_distance = config.auto_group_distance;
+                        group_distance *= (p1.size + p2.size) / 2.0;
+                        if ((p1.pos - p2.pos).length() <= group_distance + 1e-3) {
+                            nearby.push_back(id2);
+                        }
+                    }
+                }
+            }
+            std::sort(nearby.begin(), nearby.end(), [&](int a, int b) {
+                return point_rank.at(a) < point_rank.at(b);
+            });
+            nearby.erase(std::unique(nearby.begin(), nearby.end()), nearby.end());
+            for (int id2 : nearby) {
+                station_sets.join(id1, id2);
             }
         }
     }
-
-    // connect lines with common parents
+    station_sets.build_groups(station_groups, point_to_group);
+
+    // connect lines with common parents; lines are bucketed by parent so that only
+    // siblings are compared, in the same order as a scan over all pairs of lines
+    std::unordered_map<int, std::vector<int>> children_by_parent;
+    for (const auto& [id, line] : lines) {
+        if (line.parent_id == -1) continue;
+        children_by_parent[line.parent_id].push_back(id);
+    }
     for (const auto& [id1, line1] : lines) {
         if (line1.parent_id == -1) continue;
-        for (const auto& [id2, line2] : lines) {
+        for (int id2 : children_by_parent.at(line1.parent_id)) {
             if (id1 >= id2) continue;
-            if (line1.parent_id == line2.parent_id) {
-                connect_lines(id1, id2);
-            }
+            connect_lines(id1, id2);
         }
     }
 
@@ -1077,22 +1182,8 @@ Map::Map(const nlohmann::json& aarc, const nlohmann::json& config_json) {
     for (auto& [line_id, line] : lines) {
         line.is_simple = false;
         if (config.segmented_lines.contains(line_id)) continue;
-        bool has_friends = false;
-        for (const auto& [l1, l2] : config.friend_lines) {
-            if (l1 == line_id || l2 == line_id) {
-                has_friends = true;
-                break;
-            }
-        }
-        if (has_friends) continue;
-        bool has_merges = false;
-        for (const auto& [l1, l2] : config.merged_lines) {
-            if (l1 == line_id || l2 == line_id) {
-                has_merges = true;
-                break;
-            }
-        }
-        if (has_merges) continue;
+        if (config.line_friends.contains(line_id)) continue;
+        if (config.line_merges.contains(line_id)) continue;
         std::unordered_set<int> station_set;
         bool has_duplicates = false;
         // if loop line, ignore the last point (same as first)
@@ -82,7 +82,21 @@ struct Map {
         double auto_group_distance = 25.0;
         bool merge_consecutive_duplicates = true;
         bool optimize_segmentation = false;
+        bool batch_deduplication = false;
         int max_iterations = 4;
+        int optimize_time_budget_ms = 0; // 0: no time limit
+
+        enum class OptimizeStrategy {
+            Descent,
+            GoldenSection
+        } optimize_strategy = OptimizeStrategy::Descent;
+
+        enum class SearchMode {
+            BreadthFirst,
+            DepthFirst
+        } search_mode = SearchMode::BreadthFirst;
+
+        int threads = 1; // number of threads used for route search; set from the command line
         
         enum class LinkMode {
             Connect,
@@ -108,7 +122,11 @@ struct Map {
 
         std::unordered_set<std::pair<int, int>> friend_lines;
         std::unordered_set<std::pair<int, int>> merged_lines;
+        // the same relations per line: line_id -> lines it is a friend of / merged with
+        std::unordered_map<int, std::vector<int>> line_friends;
+        std::unordered_map<int, std::vector<int>> line_merges;
         std::unordered_map<int, int> segmented_lines; // line_id -> segment_length
+        std::unordered_map<int, int> segment_offsets; // line_id -> segment_offset, pinned by the config
     } config;
 
     double width;
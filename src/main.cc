@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <thread>
 
 #include "converter.h"
 
@@ -13,13 +15,43 @@ int main(int argc, char* argv[]) {
     SetConsoleOutputCP(CP_UTF8);
 #endif
 
-    char* input_aarc;
-    char* output_rc;
-    char* config_json;
+    char* input_aarc = nullptr;
+    char* output_rc = nullptr;
+    char* config_json = (char*)"";
+    int threads = 1;
 
-    if ((argc != 5 && argc != 3 && argc != 1) || (argc == 5 && std::string(argv[3]) != "--config")) {
-        std::cerr << "Usage: " << argv[0] << " <input.json> <output.json> [--config <config.json>]" << std::endl;
-        return 1;
+    if (argc != 1) {
+        int positional_count = 0;
+        bool valid = true;
+        for (int i = 1; i < argc && valid; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--config" && i + 1 < argc) {
+                config_json = argv[++i];
+            } else if (arg == "--threads" && i + 1 < argc) {
+                try {
+                    threads = std::stoi(argv[++i]);
+                } catch (...) {
+                    valid = false;
+                }
+                valid = valid && threads >= 0;
+            } else if (positional_count == 0) {
+                input_aarc = argv[i];
+                ++positional_count;
+            } else if (positional_count == 1) {
+                output_rc = argv[i];
+                ++positional_count;
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid || positional_count != 2) {
+            std::cerr << "Usage: " << argv[0] << " <input.json> <output.json> [--config <config.json>] [--threads <N>]" << std::endl;
+            return 1;
+        }
+    }
+    // --threads 0 uses every core
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
     }
     if (argc == 1) {
         std::cout << "Railchess AARC to RC Converter" << std::endl;
@@ -41,10 +73,6 @@ int main(int argc, char* argv[]) {
             config_json = new char[line.size() + 1];
             std::strcpy(config_json, line.c_str());
         }
-    } else {
-        input_aarc = argv[1];
-        output_rc = argv[2];
-        config_json = (argc == 5) ? argv[4] : (char*)"";
     }
 
     try {
@@ -70,6 +98,7 @@ int main(int argc, char* argv[]) {
         }
 
         geometry::Map map(aarc_json, config_json_data);
+        map.config.threads = threads;
         rc::Map rcmap = converter::convert_to_rc(map);
         nlohmann::json rc_json = rcmap.to_json();
         std::ofstream rc_file(output_rc);
@@ -0,0 +1,44 @@
+#include <algorithm>
+
+#include "route_count.h"
+
+namespace converter {
+
+RouteCounter::RouteCounter(const TrackGraph& graph, const std::unordered_map<int, int>& segmented_lines)
+    : graph(graph), segmented_lines(segmented_lines) {}
+
+int RouteCounter::count_from(int track_id) {
+    return count(track_id, graph.remaining_after(unlimited_remaining_count, track_id, segmented_lines));
+}
+
+void RouteCounter::invalidate(const std::unordered_set<int>& reaching_lines) {
+    std::erase_if(memo, [&](const auto& item) {
+        return reaching_lines.contains(graph.track(static_cast<int>(item.first >> 32)).line_id);
+    });
+}
+
+int RouteCounter::count(int track_id, int remaining_count) {
+    std::span<const int> nexts = graph.successors(track_id);
+    if (nexts.empty() || remaining_count <= 0) return 1;
+
+    std::uint64_t key = (static_cast<std::uint64_t>(track_id) << 32) | static_cast<std::uint32_t>(remaining_count);
+    auto [it, inserted] = memo.try_emplace(key, -1);
+    if (!inserted) {
+        // a state that is still being counted can only be reached again through a cycle without stations,
+        // which the search would never leave
+        return it->second == -1 ? count_cap : it->second;
+    }
+
+    int total = 0;
+    for (int next_id : nexts) {
+        total += count(next_id, graph.remaining_after(remaining_count, next_id, segmented_lines));
+        if (total >= count_cap) {
+            total = count_cap;
+            break;
+        }
+    }
+    memo[key] = total; // the recursion may have rehashed memo
+    return total;
+}
+
+} // namespace converter
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "track_graph.h"
+
+namespace converter {
+
+// Counts the maximal routes a search would enumerate from a track, without enumerating them.
+// The count only depends on the track and the remaining budget, so it is memoized per
+// (track, budget) state. Counts saturate at count_cap.
+class RouteCounter {
+public:
+    static constexpr int count_cap = 1 << 20;
+
+    RouteCounter(const TrackGraph& graph, const std::unordered_map<int, int>& segmented_lines);
+
+    // number of routes starting with the given track
+    int count_from(int track_id);
+
+    // forget the counts that may change after the segmentation of the given lines changed;
+    // only states on lines that can reach them are affected
+    void invalidate(const std::unordered_set<int>& reaching_lines);
+
+private:
+    const TrackGraph& graph;
+    const std::unordered_map<int, int>& segmented_lines;
+
+    // (track id, remaining count) -> number of routes; -1 while the state is being counted
+    std::unordered_map<std::uint64_t, int> memo;
+
+    int count(int track_id, int remaining_count);
+};
+
+} // namespace converter
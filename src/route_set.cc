@@ -0,0 +1,261 @@
+#include <algorithm>
+
+#include "route_set.h"
+
+namespace converter {
+
+namespace {
+
+std::uint64_t pair_key(int first, int second) {
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(first)) << 32) | 
+           static_cast<std::uint32_t>(second);
+}
+
+// distinct pairs of consecutive stations of a line
+std::vector<std::uint64_t> line_pairs(const std::vector<int>& station_ids) {
+    std::vector<std::uint64_t> keys;
+    for (size_t i = 0; i + 1 < station_ids.size(); ++i) {
+        keys.push_back(pair_key(station_ids[i], station_ids[i + 1]));
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return keys;
+}
+
+// reverse the stations if the inverse is lexicographically smaller
+void canonicalize(std::vector<int>& station_ids) {
+    if (std::lexicographical_compare(station_ids.rbegin(), station_ids.rend(), station_ids.begin(), station_ids.end())) {
+        std::reverse(station_ids.begin(), station_ids.end());
+    }
+}
+
+std::uint64_t fingerprint_of(const std::vector<int>& station_ids) {
+    std::uint64_t h = 0xcbf29ce484222325ull ^ station_ids.size();
+    for (int id : station_ids) {
+        h = (h ^ static_cast<std::uint32_t>(id)) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// whether [a_begin, a_end) appears contiguously in b
+template <typename It>
+bool is_subroute(It a_begin, It a_end, const std::vector<int>& b) {
+    if (static_cast<size_t>(std::distance(a_begin, a_end)) > b.size()) return false;
+    return std::search(b.begin(), b.end(), a_begin, a_end) != b.end();
+}
+
+void remove_id(std::unordered_map<std::uint64_t, std::vector<int>>& index, std::uint64_t key, int id) {
+    auto it = index.find(key);
+    if (it == index.end()) return;
+    auto& ids = it->second;
+    ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+    if (ids.empty()) index.erase(it);
+}
+
+} // namespace
+
+RouteSet::StationSignature::StationSignature(const std::vector<int>& station_ids) {
+    for (int id : station_ids) {
+        unsigned bit = static_cast<unsigned>((static_cast<std::uint32_t>(id) * 0x9E3779B9u) >> 24);
+        bits[bit >> 6] |= std::uint64_t(1) << (bit & 63);
+    }
+}
+
+void RouteSet::insert_line(rc::Line&& line, const StationSignature& signature, std::uint64_t fingerprint) {
+    const std::vector<int>& stations = line.station_ids;
+    for (std::uint64_t key : line_pairs(stations)) {
+        pair_lines[key].push_back(line.id);
+    }
+    head_lines[pair_key(stations[0], stations[1])].push_back(line.id);
+    fingerprint_lines[fingerprint].push_back(line.id);
+    if (length_counts.size() <= stations.size()) length_counts.resize(stations.size() + 1);
+    ++length_counts[stations.size()];
+    int id = line.id;
+    lines.emplace(id, StoredLine{std::move(line), signature, fingerprint});
+}
+
+void RouteSet::erase_line(std::unordered_map<int, StoredLine>::iterator it) {
+    const rc::Line& line = it->second.line;
+    for (std::uint64_t key : line_pairs(line.station_ids)) {
+        remove_id(pair_lines, key, line.id);
+    }
+    remove_id(head_lines, pair_key(line.station_ids[0], line.station_ids[1]), line.id);
+    remove_id(fingerprint_lines, it->second.fingerprint, line.id);
+    --length_counts[line.station_ids.size()];
+    lines.erase(it);
+}
+
+void RouteSet::clear() {
+    lines.clear();
+    fingerprint_lines.clear();
+    length_counts.clear();
+    pair_lines.clear();
+    head_lines.clear();
+}
+
+size_t RouteSet::count_longer_than(size_t station_count) const {
+    size_t total = 0;
+    for (size_t n = station_count + 1; n < length_counts.size(); ++n) {
+        total += length_counts[n];
+    }
+    return total;
+}
+
+bool RouteSet::contains_equal(const std::vector<int>& stations, std::uint64_t fingerprint) const {
+    auto it = fingerprint_lines.find(fingerprint);
+    if (it == fingerprint_lines.end()) return false;
+    for (int id : it->second) {
+        if (lines.at(id).line.station_ids == stations) return true;
+    }
+    return false;
+}
+
+bool RouteSet::contains_subroute(const std::vector<int>& stations, const StationSignature& signature) const {
+    // the route is a sub-route of an existing line only if that line contains every pair of
+    // the route (or of its inverse), so it is enough to check the lines containing the rarest one
+    for (bool reversed : {false, true}) {
+        const std::vector<int>* candidates = nullptr;
+        for (size_t i = 0; i + 1 < stations.size(); ++i) {
+            std::uint64_t key = reversed ? 
+                pair_key(stations[i + 1], stations[i]) : pair_key(stations[i], stations[i + 1]);
+            auto it = pair_lines.find(key);
+            if (it == pair_lines.end()) {
+                candidates = nullptr;
+                break;
+            }
+            if (!candidates || it->second.size() < candidates->size()) candidates = &it->second;
+        }
+        if (!candidates) continue;
+        for (int id : *candidates) {
+            const StoredLine& candidate = lines.at(id);
+            if (!signature.covered_by(candidate.signature)) continue;
+            bool found = reversed ? 
+                is_subroute(stations.rbegin(), stations.rend(), candidate.line.station_ids) :
+                is_subroute(stations.begin(), stations.end(), candidate.line.station_ids);
+            if (found) return true;
+        }
+    }
+    return false;
+}
+
+void RouteSet::add(rc::Line&& new_line) {
+    std::vector<int>& stations = new_line.station_ids;
+    if (stations.size() < 2) return;
+    canonicalize(stations);
+    std::uint64_t fingerprint = fingerprint_of(stations);
+
+    // every route is usually found once in each direction, so exact duplicates are checked first
+    if (contains_equal(stations, fingerprint)) return;
+
+    const StationSignature signature(stations);
+    if (contains_subroute(stations, signature)) {
+        // new line is sub-route of existing line, do nothing
+        return;
+    }
+
+    // an existing line is a sub-route of the new line (or of its inverse) only if it starts
+    // with a pair of consecutive stations of the new line (or of its inverse)
+    std::vector<int> candidates;
+    for (size_t i = 0; i + 1 < stations.size(); ++i) {
+        for (std::uint64_t key : {pair_key(stations[i], stations[i + 1]), pair_key(stations[i + 1], stations[i])}) {
+            auto it = head_lines.find(key);
+            if (it == head_lines.end()) continue;
+            candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    for (int id : candidates) {
+        auto it = lines.find(id);
+        if (!it->second.signature.covered_by(signature)) continue;
+        const std::vector<int>& existing = it->second.line.station_ids;
+        if (is_subroute(existing.begin(), existing.end(), stations) || 
+            is_subroute(existing.rbegin(), existing.rend(), stations)) {
+            // existing line is sub-route of new line, remove existing line
+            erase_line(it);
+        }
+    }
+
+    insert_line(std::move(new_line), signature, fingerprint);
+}
+
+void RouteSet::add_all(std::vector<rc::Line>&& new_lines, ThreadPool& thread_pool) {
+    // existing lines count as added before the new ones
+    std::vector<rc::Line> all_lines;
+    all_lines.reserve(lines.size() + new_lines.size());
+    for (auto& [id, stored] : lines) {
+        all_lines.push_back(std::move(stored.line));
+    }
+    clear();
+    std::sort(all_lines.begin(), all_lines.end(), [](const rc::Line& a, const rc::Line& b) {
+        return a.id < b.id;
+    });
+    for (auto& line : new_lines) {
+        if (line.station_ids.size() >= 2) {
+            canonicalize(line.station_ids);
+            all_lines.push_back(std::move(line));
+        }
+    }
+    new_lines.clear();
+
+    // longest first; among equal lines the earliest one is kept, as with add
+    std::stable_sort(all_lines.begin(), all_lines.end(), [](const rc::Line& a, const rc::Line& b) {
+        return a.station_ids.size() > b.station_ids.size();
+    });
+
+    // drop exact and inverse duplicates; both have the same canonical stations and fingerprint
+    std::unordered_map<std::uint64_t, std::vector<size_t>> seen;
+    std::vector<std::uint64_t> fingerprints;
+    std::vector<StationSignature> signatures;
+    size_t unique_count = 0;
+    for (auto& line : all_lines) {
+        std::uint64_t fingerprint = fingerprint_of(line.station_ids);
+        auto& same = seen[fingerprint];
+        if (std::any_of(same.begin(), same.end(), [&](size_t i) {
+            return all_lines[i].station_ids == line.station_ids;
+        })) continue;
+        if (&all_lines[unique_count] != &line) {
+            all_lines[unique_count] = std::move(line);
+        }
+        same.push_back(unique_count);
+        fingerprints.push_back(fingerprint);
+        signatures.emplace_back(all_lines[unique_count].station_ids);
+        ++unique_count;
+    }
+    all_lines.resize(unique_count);
+
+    // a line can only be a sub-route of a longer line, so lines of the same length are tested
+    // against the survivors of the longer lines only, and independently of each other
+    constexpr size_t chunk_size = 256;
+    std::vector<char> contained(unique_count);
+    for (size_t begin = 0; begin < unique_count; ) {
+        size_t end = begin;
+        while (end < unique_count && all_lines[end].station_ids.size() == all_lines[begin].station_ids.size()) {
+            ++end;
+        }
+        int chunks = static_cast<int>((end - begin + chunk_size - 1) / chunk_size);
+        thread_pool.parallel_for(chunks, [&](int chunk) {
+            size_t chunk_begin = begin + chunk * chunk_size;
+            size_t chunk_end = std::min(end, chunk_begin + chunk_size);
+            for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                contained[i] = contains_subroute(all_lines[i].station_ids, signatures[i]);
+            }
+        });
+        for (size_t i = begin; i < end; ++i) {
+            if (contained[i]) continue;
+            insert_line(std::move(all_lines[i]), signatures[i], fingerprints[i]);
+        }
+        begin = end;
+    }
+}
+
+std::unordered_map<int, rc::Line> RouteSet::release() {
+    std::unordered_map<int, rc::Line> result;
+    for (auto& [id, stored] : lines) {
+        result.emplace(id, std::move(stored.line));
+    }
+    clear();
+    return result;
+}
+
+} // namespace converter
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "rc.h"
+#include "thread_pool.h"
+
+namespace converter {
+
+// The lines emitted so far, without duplicates:
+// if a new line or its inverse is a sub-route of an existing line, it is dropped;
+// if an existing line or its inverse is a sub-route of a new line, the existing line is removed.
+// Station pairs are indexed, so each query only compares the lines that share a pair of
+// consecutive stations with the new line instead of every line in the set.
+// Each line also keeps a small bitmap of its stations; a line can only contain another one if
+// its bitmap covers the other's, which rejects most candidates before any sequence is compared.
+// Lines are stored in canonical orientation (the lexicographically smaller of the line and its
+// inverse), so a line and its inverse share one fingerprint, and inverse containment is checked
+// by scanning a line backwards instead of reversing a copy of it.
+class RouteSet {
+public:
+    void add(rc::Line&& new_line);
+
+    // add many lines at once; the result is the same as adding the existing lines and then
+    // new_lines one by one in order. Lines are sorted longest first and exact (or inverse)
+    // duplicates are dropped by hashing, so every remaining line only needs to be tested against
+    // the longer lines that survived, and lines of equal length are tested in parallel.
+    void add_all(std::vector<rc::Line>&& new_lines, ThreadPool& thread_pool);
+
+    size_t size() const { return lines.size(); }
+
+    // number of lines with more than the given number of stations
+    size_t count_longer_than(size_t station_count) const;
+
+    // move the lines out of the set, leaving it empty
+    std::unordered_map<int, rc::Line> release();
+
+private:
+    struct StationSignature {
+        std::uint64_t bits[4] = {};
+
+        explicit StationSignature(const std::vector<int>& station_ids);
+
+        bool covered_by(const StationSignature& other) const {
+            return ((bits[0] & ~other.bits[0]) | (bits[1] & ~other.bits[1]) | 
+                    (bits[2] & ~other.bits[2]) | (bits[3] & ~other.bits[3])) == 0;
+        }
+    };
+
+    struct StoredLine {
+        rc::Line line;
+        StationSignature signature;
+        std::uint64_t fingerprint;
+    };
+
+    std::unordered_map<int, StoredLine> lines;
+
+    // fingerprint -> lines with that fingerprint
+    std::unordered_map<std::uint64_t, std::vector<int>> fingerprint_lines;
+
+    // number of stations -> number of lines with that many stations
+    std::vector<size_t> length_counts;
+
+    // pair of consecutive stations -> lines containing it
+    std::unordered_map<std::uint64_t, std::vector<int>> pair_lines;
+    // pair of consecutive stations -> lines starting with it
+    std::unordered_map<std::uint64_t, std::vector<int>> head_lines;
+
+    void insert_line(rc::Line&& line, const StationSignature& signature, std::uint64_t fingerprint);
+    void erase_line(std::unordered_map<int, StoredLine>::iterator it);
+    void clear();
+
+    // whether the canonical route equals a line in the set
+    bool contains_equal(const std::vector<int>& stations, std::uint64_t fingerprint) const;
+
+    // whether the route or its inverse is a sub-route of a line in the set
+    bool contains_subroute(const std::vector<int>& stations, const StationSignature& signature) const;
+};
+
+} // namespace converter
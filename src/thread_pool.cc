@@ -0,0 +1,102 @@
+#include "thread_pool.h"
+
+namespace converter {
+
+namespace {
+
+// the queue owned by the current thread and the pool it belongs to
+thread_local const void* current_pool = nullptr;
+thread_local int current_queue = -1;
+
+} // namespace
+
+ThreadPool::ThreadPool(int threads) {
+    for (int i = 1; i < threads; ++i) {
+        queues.push_back(std::make_unique<TaskQueue>());
+    }
+    for (int i = 0; i + 1 < threads; ++i) {
+        workers.emplace_back([this, i]() { worker_loop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    if (queues.empty()) {
+        task();
+        return;
+    }
+    // tasks submitted by a worker go to its own deque; others are spread round-robin
+    int index = current_pool == this ? current_queue : 
+        static_cast<int>(next_queue++ % queues.size());
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        ++pending_count;
+    }
+    wake.notify_one();
+}
+
+bool ThreadPool::pop_task(int queue_index, std::function<void()>& task) {
+    if (queue_index >= 0) {
+        auto& own = *queues[queue_index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --pending_count;
+            return true;
+        }
+    }
+    int count = static_cast<int>(queues.size());
+    for (int k = 1; k <= count; ++k) {
+        int victim = (queue_index + k + count) % count;
+        if (victim == queue_index) continue;
+        auto& other = *queues[victim];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (!other.tasks.empty()) {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            --pending_count;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::run_pending_task() {
+    if (queues.empty() || pending_count == 0) return false;
+    std::function<void()> task;
+    if (!pop_task(current_pool == this ? current_queue : -1, task)) return false;
+    task();
+    return true;
+}
+
+void ThreadPool::worker_loop(int queue_index) {
+    current_pool = this;
+    current_queue = queue_index;
+    while (true) {
+        std::function<void()> task;
+        if (pop_task(queue_index, task)) {
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake.wait(lock, [this]() { return stopping || pending_count > 0; });
+        if (stopping) return;
+    }
+}
+
+} // namespace converter
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace converter {
+
+// A work-stealing thread pool. Every worker owns a deque of tasks: it runs its own tasks
+// newest first and, once it runs out, steals the oldest tasks of the other workers.
+// Threads waiting for tasks to finish run pending tasks instead of blocking, so tasks
+// may themselves submit tasks and wait for them.
+class ThreadPool {
+public:
+    // threads <= 1 starts no workers; all tasks then run on the waiting thread
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // number of threads that can run tasks at the same time, including the waiting thread
+    int size() const { return static_cast<int>(workers.size()) + 1; }
+
+    void submit(std::function<void()> task);
+
+    // run one pending task on the calling thread; returns false if there was none
+    bool run_pending_task();
+
+    // run f(0), ..., f(n - 1) on the pool and wait for all of them;
+    // the first exception thrown by a task is rethrown here
+    template <typename F>
+    void parallel_for(int n, F&& f) {
+        std::atomic<int> remaining(n);
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        for (int i = 0; i < n; ++i) {
+            submit([&, i]() {
+                try {
+                    f(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) error = std::current_exception();
+                }
+                --remaining;
+            });
+        }
+        while (remaining > 0) {
+            if (!run_pending_task()) std::this_thread::yield();
+        }
+        if (error) std::rethrow_exception(error);
+    }
+
+private:
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<TaskQueue>> queues; // one per worker
+    std::vector<std::thread> workers;
+
+    std::atomic<int> pending_count{0};
+    std::atomic<unsigned> next_queue{0};
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    bool pop_task(int queue_index, std::function<void()>& task);
+    void worker_loop(int queue_index);
+};
+
+} // namespace converter
@@ -0,0 +1,193 @@
+#include <algorithm>
+
+#include "track_graph.h"
+
+namespace converter {
+
+TrackGraph::TrackGraph(const geometry::Map& geomap) : geomap(geomap) {
+    std::unordered_map<int, std::vector<int>> point_tracks;
+    for (const auto& [point_id, point] : geomap.points) {
+        point_tracks[point_id];
+    }
+
+    auto add_track = [&](Track track) {
+        int track_id = static_cast<int>(tracks.size());
+        track.is_station = geomap.points.at(track.point_id).type == geometry::Point::Type::Station;
+        tracks.push_back(track);
+        point_tracks[track.point_id].push_back(track_id);
+        if (!track.is_end) {
+            line_tracks[track.line_id][track.index_in_line * 2 + (track.forward ? 1 : 0)] = track_id;
+        }
+    };
+
+    for (const auto& [line_id, line] : geomap.lines) {
+        line_tracks[line_id].assign(line.point_ids.size() * 2, -1);
+        for (size_t i = 0; i < line.point_ids.size(); ++i) {
+            int pid = line.point_ids[i];
+            if (!point_tracks.contains(pid)) continue;
+            if (i + 1 < line.point_ids.size()) {
+                add_track(Track{
+                    .point_id = pid,
+                    .line_id = line_id,
+                    .index_in_line = static_cast<int>(i),
+                    .forward = true
+                });
+            }
+            if (i > 0) {
+                add_track(Track{
+                    .point_id = pid,
+                    .line_id = line_id,
+                    .index_in_line = static_cast<int>(i),
+                    .forward = false
+                });
+            }
+            if (i == 0 && !line.is_loop) {
+                add_track(Track{
+                    .point_id = pid,
+                    .line_id = line_id,
+                    .index_in_line = static_cast<int>(i),
+                    .forward = false,
+                    .is_end = true
+                });
+            }
+            if (i + 1 == line.point_ids.size() && !line.is_loop) {
+                add_track(Track{
+                    .point_id = pid,
+                    .line_id = line_id,
+                    .index_in_line = static_cast<int>(i),
+                    .forward = true,
+                    .is_end = true
+                });
+            }
+        }
+    }
+
+    // pre-compute the tracks a route may continue on after each track
+    successor_offsets.reserve(tracks.size() + 1);
+    successor_offsets.push_back(0);
+    for (const auto& track : tracks) {
+        size_t begin = successor_ids.size();
+        if (!track.is_end) {
+            int next_pid = geomap.lines.at(track.line_id).point_ids[track.get_next_index()];
+            auto pt_it = point_tracks.find(next_pid);
+            if (pt_it != point_tracks.end()) {
+                for (int next_id : pt_it->second) {
+                    const Track& t = tracks[next_id];
+                    if (t.line_id == track.line_id && t.index_in_line == track.get_next_index()) {
+                        if (t.forward == track.forward || t.is_end) {
+                            successor_ids.push_back(next_id);
+                        }
+                        continue;
+                    }
+                    if (t.is_end) continue;
+                    bool is_friend = geomap.config.friend_lines.contains({track.line_id, t.line_id}) || 
+                                     track.line_id == t.line_id;
+                    bool is_merged = geomap.config.merged_lines.contains({track.line_id, t.line_id});
+                    if (is_merged) {
+                        successor_ids.push_back(next_id);
+                        continue;
+                    }
+                    if (!is_friend) continue;
+                    int pid_after_next = geomap.lines.at(t.line_id).point_ids[t.get_next_index()];
+                    if (geomap.can_move_through(track.point_id, next_pid, pid_after_next)) {
+                        successor_ids.push_back(next_id);
+                    }
+                }
+            }
+        }
+        if (successor_ids.size() - begin > 1) {
+            // the end of the line is only a successor if there is no other way to continue
+            successor_ids.erase(std::remove_if(successor_ids.begin() + begin, successor_ids.end(), [&](int id) {
+                return tracks[id].is_end;
+            }), successor_ids.end());
+        }
+        successor_offsets.push_back(static_cast<int>(successor_ids.size()));
+    }
+
+    // longest route from each track, by a depth-first search over the successors;
+    // a track whose successor is still on the stack closes a cycle
+    constexpr int unvisited = -1;
+    constexpr int in_progress = -2;
+    max_station_counts.assign(tracks.size(), unvisited);
+    std::vector<std::pair<int, int>> stack; // (track id, index of the next successor)
+    for (int start = 0; start < track_count(); ++start) {
+        if (max_station_counts[start] != unvisited) continue;
+        max_station_counts[start] = in_progress;
+        stack.emplace_back(start, 0);
+        while (!stack.empty()) {
+            int track_id = stack.back().first;
+            std::span<const int> nexts = successors(track_id);
+            if (stack.back().second < static_cast<int>(nexts.size())) {
+                int next_id = nexts[stack.back().second++];
+                if (max_station_counts[next_id] == unvisited) {
+                    max_station_counts[next_id] = in_progress;
+                    stack.emplace_back(next_id, 0);
+                }
+                continue;
+            }
+            int longest = 0;
+            for (int next_id : nexts) {
+                int count = max_station_counts[next_id];
+                if (count == in_progress || count == unbounded_station_count) {
+                    longest = unbounded_station_count;
+                    break;
+                }
+                longest = std::max(longest, count);
+            }
+            max_station_counts[track_id] = longest == unbounded_station_count ? 
+                unbounded_station_count : longest + (tracks[track_id].is_station ? 1 : 0);
+            stack.pop_back();
+        }
+    }
+
+    for (int track_id = 0; track_id < track_count(); ++track_id) {
+        int line_id = tracks[track_id].line_id;
+        for (int next_id : successors(track_id)) {
+            int next_line_id = tracks[next_id].line_id;
+            if (next_line_id == line_id) continue;
+            auto& preds = line_predecessors[next_line_id];
+            if (std::find(preds.begin(), preds.end(), line_id) == preds.end()) {
+                preds.push_back(line_id);
+            }
+        }
+    }
+}
+
+int TrackGraph::find_track(int line_id, int index_in_line, bool forward) const {
+    auto it = line_tracks.find(line_id);
+    if (it == line_tracks.end()) return -1;
+    size_t slot = static_cast<size_t>(index_in_line) * 2 + (forward ? 1 : 0);
+    if (index_in_line < 0 || slot >= it->second.size()) return -1;
+    return it->second[slot];
+}
+
+std::unordered_set<int> TrackGraph::lines_reaching(const std::vector<int>& line_ids) const {
+    std::unordered_set<int> result(line_ids.begin(), line_ids.end());
+    std::vector<int> stack(line_ids.begin(), line_ids.end());
+    while (!stack.empty()) {
+        int line_id = stack.back();
+        stack.pop_back();
+        auto it = line_predecessors.find(line_id);
+        if (it == line_predecessors.end()) continue;
+        for (int pred : it->second) {
+            if (result.insert(pred).second) {
+                stack.push_back(pred);
+            }
+        }
+    }
+    return result;
+}
+
+int TrackGraph::remaining_after(
+    int remaining_count, int track_id,
+    const std::unordered_map<int, int>& segmented_lines
+) const {
+    const Track& t = tracks[track_id];
+    if (t.is_station) {
+        --remaining_count;
+    }
+    auto it = segmented_lines.find(t.line_id);
+    return std::min(remaining_count, it != segmented_lines.end() ? it->second : geomap.config.max_length);
+}
+
+} // namespace converter
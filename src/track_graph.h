@@ -0,0 +1,79 @@
+#pragma once
+
+#include <climits>
+#include <span>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "geometry.h"
+
+namespace converter {
+
+// An entry of the track table. Routes refer to tracks by their index in the table,
+// so these fields are stored once per track instead of once per route step.
+struct Track {
+    int point_id;
+    int line_id;
+    int index_in_line;
+    bool forward;
+    bool is_end = false;
+    bool is_station = false;
+
+    int get_next_index() const {
+        return forward ? index_in_line + 1 : index_in_line - 1;
+    }
+};
+
+// The tracks of a map and the tracks a route may continue on after each of them.
+// It only depends on the map, so it is built once and shared by every route search on that map.
+// Tracks are identified by their index in the track table; successors are stored in CSR form.
+// budget of a route before its first track; effectively infinite
+constexpr int unlimited_remaining_count = 65535;
+
+// route length of a track from which a route can run into a cycle
+constexpr int unbounded_station_count = INT_MAX;
+
+struct TrackGraph {
+    const geometry::Map& geomap;
+
+    explicit TrackGraph(const geometry::Map& geomap);
+
+    int track_count() const { return static_cast<int>(tracks.size()); }
+    const Track& track(int track_id) const { return tracks[track_id]; }
+
+    std::span<const int> successors(int track_id) const {
+        return {successor_ids.data() + successor_offsets[track_id],
+                successor_ids.data() + successor_offsets[track_id + 1]};
+    }
+
+    // index of the (non-end) track leaving the given position of a line, or -1 if there is none
+    int find_track(int line_id, int index_in_line, bool forward) const;
+
+    // most stations on a route starting with the given track, regardless of the budget
+    int max_stations_from(int track_id) const { return max_station_counts[track_id]; }
+
+    // every line from which a route can reach one of the given lines, including the lines themselves
+    std::unordered_set<int> lines_reaching(const std::vector<int>& line_ids) const;
+
+    // remaining station budget of a route after it moves onto the given track
+    int remaining_after(
+        int remaining_count, int track_id,
+        const std::unordered_map<int, int>& segmented_lines
+    ) const;
+
+private:
+    std::vector<Track> tracks;
+    std::vector<int> successor_offsets;
+    std::vector<int> successor_ids;
+
+    std::vector<int> max_station_counts;
+
+    // line id -> track index for each (index_in_line, forward) pair
+    std::unordered_map<int, std::vector<int>> line_tracks;
+
+    // line id -> lines with a track that continues onto this line
+    std::unordered_map<int, std::vector<int>> line_predecessors;
+};
+
+} // namespace converter